@@ -46,8 +46,15 @@ LICENSE:
 #include "avr-i2c-cmdslave.h"
 
 // I2C configuration provided by the application
+#ifdef I2C_PROGMEM_COMMANDS
+extern const i2cCommand i2c_registerMap[] PROGMEM;
+extern const uint8_t i2c_registerIndex[] PROGMEM;
+#define I2C_CMD_LOOKUP(code)  pgm_read_byte(&i2c_registerIndex[(code)])
+#else
 extern i2cCommand i2c_registerMap[];
 extern volatile uint8_t i2c_registerIndex[];
+#define I2C_CMD_LOOKUP(code)  (i2c_registerIndex[(code)])
+#endif
 // Required commands since the library uses them
 #ifdef I2C_ENABLE_PAGE
 extern volatile uint8_t I2C_PAGE[1];
@@ -67,22 +74,76 @@ volatile uint8_t I2C_STATUS_CML[1];
 
 // Some helper macros
 #ifdef I2C_ENABLE_PAGE
-#define IS_PAGED           (i2c_registerMap[i2c_registerMapIndex].attributes & I2C_PAGED)
+#define IS_PAGED           (i2c_cmd->attributes & I2C_PAGED)
 #else
 #define IS_PAGED           (0)
 #endif
-#define IS_BLOCKCMD        (i2c_registerMap[i2c_registerMapIndex].attributes & I2C_BLOCK)
-#define IS_LBLOCK          (i2c_registerMap[i2c_registerMapIndex].attributes & I2C_LEN)
+#define IS_BLOCKCMD        (i2c_cmd->attributes & I2C_BLOCK)
+#define IS_LBLOCK          (i2c_cmd->attributes & I2C_LEN)
+#define IS_DIRECT          ((i2c_cmd->attributes & (I2C_DIRECT | I2C_BLOCK)) == I2C_DIRECT)
+
+// Command currently being processed, looked up once when the command code arrives so the
+// per-byte paths don't have to index i2c_registerIndex or i2c_registerMap again.  With the table in flash the
+// fields the ISR uses are read into RAM at that point; cmdCode isn't one of them, since
+// i2c_command.code already holds it.
+#ifdef I2C_PROGMEM_COMMANDS
+static i2cCommand i2c_cmdCopy;
+static i2cCommand * const i2c_cmd = &i2c_cmdCopy;
+
+static inline void i2c_select_command(uint8_t idx)
+{
+	i2c_cmdCopy.attributes = pgm_read_byte(&i2c_registerMap[idx].attributes);
+	i2c_cmdCopy.readBytes = pgm_read_byte(&i2c_registerMap[idx].readBytes);
+	i2c_cmdCopy.writeBytes = pgm_read_byte(&i2c_registerMap[idx].writeBytes);
+	i2c_cmdCopy.ramAddr = pgm_read_ptr(&i2c_registerMap[idx].ramAddr);
+}
+#else
+static i2cCommand *i2c_cmd = &i2c_registerMap[0];
 
-// Internal index to the i2c_registerMap array
-static volatile uint8_t i2c_registerMapIndex;
+static inline void i2c_select_command(uint8_t idx)
+{
+	i2c_cmd = &i2c_registerMap[idx];
+}
+#endif
 
 static uint8_t i2c_state;
 static uint8_t i2c_pec;
 static uint8_t i2c_baseAddress;
 static uint8_t i2c_status;
-static uint8_t i2c_buffer[256];
+// Sized from I2C_COMMANDS when it is given, to fit the largest staged command
+static uint8_t i2c_buffer[I2C_WRITE_BUFFER_SIZE];
 static CmdBuffer i2c_command;
+static uint8_t i2c_cmdUnsupported;   // i2c_command.code isn't in the table, set when the code arrives
+
+#ifdef I2C_ENABLE_STATS
+static I2CSlaveStats i2c_stats;
+static uint16_t i2c_startTime = 0;
+I2CSlaveStats i2c_statsReport;
+
+#define I2C_STATS_COUNT(field)  (i2c_stats.field++)
+#define I2C_STATS_BEGIN()       (i2c_startTime = I2C_STATS_TIMER)
+#define I2C_STATS_END()         (i2c_stats.busyTime += (uint16_t)(I2C_STATS_TIMER - i2c_startTime))
+
+void i2c_stats_snapshot(I2CSlaveStats *stats)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		memcpy(stats, &i2c_stats, sizeof(I2CSlaveStats));
+	}
+}
+
+void i2c_stats_reset(void)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		memset(&i2c_stats, 0, sizeof(I2CSlaveStats));
+	}
+}
+#else
+#define I2C_STATS_COUNT(field)  ((void)0)
+#define I2C_STATS_BEGIN()       ((void)0)
+#define I2C_STATS_END()         ((void)0)
+#endif
 
 uint8_t i2cCmdQueueDepth(void)
 {
@@ -97,7 +158,8 @@ uint8_t i2cCmdQueueDepth(void)
 	return(result);
 }
 
-uint8_t i2cCmdQueuePush(CmdBuffer* data)
+// Unlocked version for the ISR, inlined so the ISR makes no calls
+static inline uint8_t i2cCmdQueuePut(CmdBuffer* data)
 {
 	// If full, bail with a false
 	if (cmdQueueFull)
@@ -108,12 +170,19 @@ uint8_t i2cCmdQueuePush(CmdBuffer* data)
 
 	if( ++cmdQueueHead >= I2C_CMD_BUFFER_SIZE )
 		cmdQueueHead = 0;
+	if (cmdQueueHead == cmdQueueTail)
+		cmdQueueFull = 1;
+	return(1);
+}
+
+uint8_t i2cCmdQueuePush(CmdBuffer* data)
+{
+	uint8_t result;
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		if (cmdQueueHead == cmdQueueTail)
-			cmdQueueFull = 1;;
+		result = i2cCmdQueuePut(data);
 	}
-	return(1);
+	return(result);
 }
 
 uint8_t i2cCmdQueuePop(CmdBuffer* data)
@@ -170,7 +239,7 @@ const uint8_t crcTable[256] PROGMEM = {
 	0xe6, 0xe1, 0xe8, 0xef, 0xfa, 0xfd, 0xf4, 0xf3
 };
 
-void i2c_calculatePec(uint8_t data)
+static inline void i2c_calculatePec(uint8_t data)
 {
 	i2c_pec ^= data;
 	i2c_pec = pgm_read_byte(&(crcTable[i2c_pec]));
@@ -189,12 +258,21 @@ volatile uint8_t i2c_busy = 0;
 void i2c_slave_init(uint8_t i2c_address, uint8_t i2c_all_call)
 {
 	TWBR = I2C_TWBR;
+#ifdef I2C_NO_GENERAL_CALL
+	(void)i2c_all_call;
+	TWAR = ((i2c_address<<1) & 0xFE);                                                 // Set own TWI slave address, general calls compiled out
+#else
 	TWAR = ((i2c_address<<1) & 0xFE) | (i2c_all_call?1:0);                            // Set own TWI slave address. Accept TWI General Calls.
+#endif
 	TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT);
 	i2c_busy = 0;
 	i2c_baseAddress = i2c_address;
 	i2c_pec = 0;
 	I2C_STATUS_CML[0] = 0;
+#ifdef I2C_PROGMEM_COMMANDS
+	i2c_select_command(0);
+#endif
+	i2c_cmdUnsupported = (I2C_UNSUPPORTED == I2C_CMD_LOOKUP(i2c_command.code));
 	
 	// Initialize command queue
 	cmdQueueHead = cmdQueueTail = 0;
@@ -205,6 +283,29 @@ void i2c_slave_init(uint8_t i2c_address, uint8_t i2c_all_call)
 
 // FIXME: Add ARA support?
 
+/****************************************************************************
+Every byte on the bus is clock stretched for as long as this ISR runs, so it
+is kept free of calls and per-byte table walks: the current command is looked
+up once when its code arrives (with I2C_PROGMEM_COMMANDS, just the four fields
+used are read from flash), and the PEC update and command queue push are
+inlined.  On a part without MUL the page offset multiply is a libgcc call.
+The STOP commit loops over the staged bytes, so it grows with writeBytes, and
+with I2C_ENABLE_STATS a read of the stats command copies the counters at SLA+R.
+Leaving I2C_ENABLE_PAGE undefined removes the page offset arithmetic, and
+I2C_NO_GENERAL_CALL drops the general call states.
+
+Worst case cycles from the vector to RETI with avr-gcc -Os for the ATmega328p,
+as counted by "make isr-cycles MODULE=avr-i2c-cmdslave OPTS=..." (add 7 for the
+interrupt response and the vector's JMP).  "make isr-budget" fails if one of
+these option sets has grown past its figure, or still has "-" because it hasn't
+been measured.  "make isr-calls" fails if the ISR contains a call.
+
+	isr-budget  base                                                     -
+	isr-budget  I2C_NO_GENERAL_CALL                                      -
+	isr-budget  I2C_ENABLE_PAGE+I2C_ENABLE_STATUS_WORD+I2C_ENABLE_CML    -
+	isr-budget  I2C_PROGMEM_COMMANDS                                     -
+	isr-budget  I2C_ENABLE_STATS                                         -
+****************************************************************************/
 ISR(TWI_vect)
 {
 	uint8_t data;
@@ -216,15 +317,23 @@ ISR(TWI_vect)
 		case I2C_STX_ADR_ACK:              // Own SLA+R has been received; ACK has been returned
 			i2c_txIdx = 1;                 // Initialize transmit byte count (1 based to be consistent with data byte count when receiving; 0 was slave addr)
 			i2c_calculatePec((i2c_baseAddress << 1) + 1);
-			// Fall through to next case in order to preload data byte
+			I2C_STATS_BEGIN();
+			I2C_STATS_COUNT(addressMatches);
+#ifdef I2C_ENABLE_STATS
+			// An unsupported code was already counted when it was written
+			if (!i2c_cmdUnsupported && (i2c_cmd->ramAddr == (uint8_t*)&i2c_statsReport))
+				i2c_statsReport = i2c_stats;
+#endif
+			// Fall through - to next case in order to preload data byte
 		case I2C_STX_DATA_ACK:             // Data byte in TWDR has been transmitted; ACK has been received
+			I2C_STATS_COUNT(bytesSent);
 			txIndex = (IS_BLOCKCMD?i2c_txIdx-1:i2c_txIdx);  // Mangle index to handle block reads.  Do it once here.
-			if (I2C_UNSUPPORTED == i2c_registerIndex[i2c_command.code])
+			if (i2c_cmdUnsupported)
 			{
 				TWDR = 0xFF;  // Drive 0xFF so bus is released
 				i2c_txIdx++;
 			}
-			else if(0 == i2c_registerMap[i2c_registerMapIndex].readBytes)
+			else if(0 == i2c_cmd->readBytes)
 			{
 				// Send byte command (write only)
 				i2c_status |= STATUS_CML_I2C_FAULT;
@@ -237,18 +346,18 @@ ISR(TWI_vect)
 				if(IS_LBLOCK)
 				{
 					uint16_t pageOffset;  // 16 bits to handle word reads with page > 127
-					pageOffset = (IS_PAGED ? (I2C_PAGE[0] * (i2c_registerMap[i2c_registerMapIndex].readBytes + (IS_LBLOCK?1:0))) : 0);
-					data = *(i2c_registerMap[i2c_registerMapIndex].ramAddr + pageOffset);
+					pageOffset = (IS_PAGED ? (I2C_PAGE[0] * (i2c_cmd->readBytes + (IS_LBLOCK?1:0))) : 0);
+					data = *(i2c_cmd->ramAddr + pageOffset);
 				}
 				else
 				{
-					data = i2c_registerMap[i2c_registerMapIndex].readBytes;
+					data = i2c_cmd->readBytes;
 				}
 				TWDR = data;
 				i2c_calculatePec(data);
 				i2c_txIdx++;
 			}
-			else if(txIndex <= i2c_registerMap[i2c_registerMapIndex].readBytes)
+			else if(txIndex <= i2c_cmd->readBytes)
 			{
 				if( IS_PAGED && (0xFF == I2C_PAGE[0]) )
 				{
@@ -259,21 +368,21 @@ ISR(TWI_vect)
 				else
 				{
 					uint16_t pageOffset;  // 16 bits to handle word reads with page > 127
-					pageOffset = (IS_PAGED ? (I2C_PAGE[0] * (i2c_registerMap[i2c_registerMapIndex].readBytes + (IS_LBLOCK?1:0))) : 0);
-					if(i2c_registerMap[i2c_registerMapIndex].attributes & I2C_SKIP_BYTE)
+					pageOffset = (IS_PAGED ? (I2C_PAGE[0] * (i2c_cmd->readBytes + (IS_LBLOCK?1:0))) : 0);
+					if(i2c_cmd->attributes & I2C_SKIP_BYTE)
 						pageOffset *= 2;  // Read byte size registers from word size source
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-					data = *(i2c_registerMap[i2c_registerMapIndex].ramAddr + pageOffset + (IS_LBLOCK?1:0) + txIndex - 1);
+					data = *(i2c_cmd->ramAddr + pageOffset + (IS_LBLOCK?1:0) + txIndex - 1);
 #elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
 					// Mangle byte order since SMBus sends lowest byte first - Read from end to the beginning
-					data = *(i2c_registerMap[i2c_registerMapIndex].ramAddr + pageOffset + i2c_registerMap[i2c_registerMapIndex].readBytes + (IS_LBLOCK?1:0) - txIndex);
+					data = *(i2c_cmd->ramAddr + pageOffset + i2c_cmd->readBytes + (IS_LBLOCK?1:0) - txIndex);
 #endif
 					TWDR = data;
 					i2c_calculatePec(data);
 				}
 				i2c_txIdx++;
 			}
-			else if(txIndex == (i2c_registerMap[i2c_registerMapIndex].readBytes + 1))
+			else if(txIndex == (i2c_cmd->readBytes + 1))
 			{
 				// Send PEC
 				TWDR = i2c_pec;
@@ -282,6 +391,7 @@ ISR(TWI_vect)
 			else
 			{
 				// Too many bytes read, set status
+				I2C_STATS_COUNT(overruns);
 				i2c_status |= STATUS_CML_I2C_FAULT;
 				TWDR = 0xFF;  // Drive 0xFF so bus is released
 				i2c_txIdx++;
@@ -291,12 +401,17 @@ ISR(TWI_vect)
 			break;
 
 		case I2C_STX_DATA_NACK:          // Data byte in TWDR has been transmitted; NACK has been received. 
+			I2C_STATS_END();
 			TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWEA);
 			i2c_busy = 0;   // Transmit is finished, we are not busy anymore
 			break;     
 
+#ifndef I2C_NO_GENERAL_CALL
 		case I2C_SRX_GEN_ACK:            // General call address has been received; ACK has been returned
+#endif
 		case I2C_SRX_ADR_ACK:            // Own SLA+W has been received ACK has been returned
+			I2C_STATS_BEGIN();
+			I2C_STATS_COUNT(addressMatches);
 			i2c_pec = 0;
 			i2c_state &= ~I2C_STATE_ERROR;  // Clear error flag
 			i2c_calculatePec(i2c_baseAddress << 1);
@@ -305,26 +420,32 @@ ISR(TWI_vect)
 			break;
 
 		case I2C_SRX_ADR_DATA_ACK:       // Previously addressed with own SLA+W; data has been received; ACK has been returned
+#ifndef I2C_NO_GENERAL_CALL
 		case I2C_SRX_GEN_DATA_ACK:       // Previously addressed with general call; data has been received; ACK has been returned
+#endif
 			data = TWDR;
+			I2C_STATS_COUNT(bytesReceived);
 			if (0 == i2c_rxIdx)
 			{
 				// First byte of a write, this is the command code
 				i2c_command.code = data;  // Save for command processing in application or for validating a read operation
 				i2c_command.page = I2C_PAGE[0];  // Save for command processing in application
-				if(I2C_UNSUPPORTED == i2c_registerIndex[i2c_command.code])
+				data = I2C_CMD_LOOKUP(data);    // The only table lookup for this command
+				i2c_cmdUnsupported = (I2C_UNSUPPORTED == data);
+				if(i2c_cmdUnsupported)
 				{
 					// Set error if unsupported
+					I2C_STATS_COUNT(unsupported);
 					i2c_status |= STATUS_CML_CMD_FAULT;
 				}
 				else
 				{
-					i2c_registerMapIndex = i2c_registerIndex[i2c_command.code]; // Save command pointer for future processing
-					writeBytes = i2c_registerMap[i2c_registerMapIndex].writeBytes;  // Save write bytes; block command will override later
-					i2c_calculatePec(data);
+					i2c_select_command(data); // Save command for future processing
+					writeBytes = i2c_cmd->writeBytes;  // Save write bytes; block command will override later
+					i2c_calculatePec(i2c_command.code);
 				}
 			}
-			else if (I2C_UNSUPPORTED == i2c_registerIndex[i2c_command.code])
+			else if (i2c_cmdUnsupported)
 			{
 				// Subsequent writes to unsupported command
 				// Do nothing
@@ -335,15 +456,16 @@ ISR(TWI_vect)
 				if(i2c_rxIdx == (writeBytes + 1))
 				{
 					// First extra byte... Maybe PEC?
-					if( (i2c_pec != data) && ((0 != i2c_registerMap[i2c_registerMapIndex].writeBytes) || (0 == i2c_registerMap[i2c_registerMapIndex].readBytes)) )
+					if( (i2c_pec != data) && ((0 != i2c_cmd->writeBytes) || (0 == i2c_cmd->readBytes)) )
 					{
 						// PEC doesn't match and it's a writeable command or a send byte command - throw an error
 						if( !(i2c_state & I2C_STATE_ERROR) )
 						{
+							I2C_STATS_COUNT(pecFaults);
 							i2c_status |= STATUS_CML_PEC_FAULT;
 						}
 					}
-					else if( (0 == i2c_registerMap[i2c_registerMapIndex].writeBytes) && (i2c_registerMap[i2c_registerMapIndex].readBytes > 0) )
+					else if( (0 == i2c_cmd->writeBytes) && (i2c_cmd->readBytes > 0) )
 					{
 						// Read-only command - throw a different error
 						i2c_status |= STATUS_CML_DATA_FAULT;
@@ -352,6 +474,7 @@ ISR(TWI_vect)
 				else
 				{
 					// Beyond PEC, throw an error (unless already flagged as PEC mismatch)
+					I2C_STATS_COUNT(overruns);
 					if( !(i2c_state & I2C_STATE_ERROR) )
 					{
 						i2c_status |= STATUS_CML_DATA_FAULT;
@@ -361,7 +484,7 @@ ISR(TWI_vect)
 			else if ( IS_BLOCKCMD && (1 == i2c_rxIdx) )
 			{
 				// Block length
-				if(data > i2c_registerMap[i2c_registerMapIndex].writeBytes)
+				if(data > i2c_cmd->writeBytes)
 				{
 					i2c_status |= STATUS_CML_DATA_FAULT;
 				}
@@ -371,7 +494,7 @@ ISR(TWI_vect)
 			else
 			{
 				// Write data to command
-				if( (0x00 == i2c_registerMap[i2c_registerMapIndex].cmdCode) && (data >= I2C_NUMPAGES) && (data < 0xFF) )
+				if( (0x00 == i2c_command.code) && (data >= I2C_NUMPAGES) && (data < 0xFF) )
 				{
 					// Special handling of a write to PAGE with an illegal value but allows 0xFF
 					i2c_status |= STATUS_CML_DATA_FAULT;
@@ -383,8 +506,25 @@ ISR(TWI_vect)
 				}
 				else
 				{
-					// If we got here, everything is good.  Write the value! (to the buffer)
-					i2c_buffer[i2c_rxIdx-(IS_BLOCKCMD?2:1)] = data;
+					// If we got here, everything is good.  Write the value!
+					if (IS_DIRECT)
+					{
+						// Partial writes are fine for this one, so put it straight in memory
+						uint8_t i = i2c_rxIdx - 1;
+						uint16_t pageOffset = (IS_PAGED ? (I2C_PAGE[0] * i2c_cmd->writeBytes) : 0);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+						*(i2c_cmd->ramAddr + pageOffset + i) = data;
+#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+						*(i2c_cmd->ramAddr + pageOffset + i2c_cmd->writeBytes - 1 - i) = data;
+#endif
+					}
+					else
+					{
+						// Staged until STOP.  A bogus block length has already been flagged, just don't overrun
+						uint16_t i = i2c_rxIdx - (IS_BLOCKCMD?2:1);
+						if (i < I2C_WRITE_BUFFER_SIZE)
+							i2c_buffer[i] = data;
+					}
 					i2c_calculatePec(data);
 				}
 			}
@@ -397,47 +537,62 @@ ISR(TWI_vect)
                                                         // Enter not addressed mode and listen to address match
 			TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWEA);  // Enable TWI-interface and release TWI pins
 			i2c_busy = 0;  // We are waiting for a new address match, so we are not busy
+			I2C_STATS_END();
 
 			if(!(i2c_state & I2C_STATE_ERROR))
 			{
 				// Done writing data.  Do something if no error since last SLA+W.
-				if( (0 == i2c_registerMap[i2c_registerMapIndex].readBytes) && (0 == i2c_registerMap[i2c_registerMapIndex].writeBytes) )
+				if( (0 == i2c_cmd->readBytes) && (0 == i2c_cmd->writeBytes) )
 				{
 					// Send byte command
-					i2cCmdQueuePush(&i2c_command);
+					i2cCmdQueuePut(&i2c_command);
 				}
-				else if(i2c_rxIdx > writeBytes)
+				else if((i2c_rxIdx > writeBytes) && !IS_DIRECT)
 				{
 					// We received at least the correct amount of data (extra beyond PEC gets flagged as error), so write to actual register
-					uint8_t i;
-					uint16_t pageOffset;  // 16 bits to handle word writes with page > 127
-					pageOffset = (IS_PAGED ? (I2C_PAGE[0] * (i2c_registerMap[i2c_registerMapIndex].writeBytes + (IS_LBLOCK?1:0))) : 0);
-					if(IS_LBLOCK)
+					uint16_t count = (IS_BLOCKCMD?writeBytes-1:writeBytes);  // Copy only the number of bytes written.  Subtract one for length byte in block commands
+					if (count > I2C_WRITE_BUFFER_SIZE)
 					{
-						*(i2c_registerMap[i2c_registerMapIndex].ramAddr + pageOffset) = writeBytes - 1;  // Store length in first byte
+						// Command is bigger than the staging buffer, so its tail was never kept
+						i2c_status |= STATUS_CML_DATA_FAULT;
 					}
-					for(i=0; i<(IS_BLOCKCMD?writeBytes-1:writeBytes); i++)  // Copy only the number of bytes written.  Subtract one for length byte in block commands
+					else
 					{
+						uint16_t pageOffset;  // 16 bits to handle word writes with page > 127
+						uint8_t i;
+						pageOffset = (IS_PAGED ? (I2C_PAGE[0] * (i2c_cmd->writeBytes + (IS_LBLOCK?1:0))) : 0);
+						if(IS_LBLOCK)
+						{
+							*(i2c_cmd->ramAddr + pageOffset) = writeBytes - 1;  // Store length in first byte
+						}
+						for(i=0; i<count; i++)
+						{
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-						*(i2c_registerMap[i2c_registerMapIndex].ramAddr + pageOffset + (IS_LBLOCK?1:0) + i) = i2c_buffer[i];
+							*(i2c_cmd->ramAddr + pageOffset + (IS_LBLOCK?1:0) + i) = i2c_buffer[i];
 #elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-						// Unmangle byte order since SMBus sends lowest byte first - Write from end to the beginning
-						*(i2c_registerMap[i2c_registerMapIndex].ramAddr + pageOffset + i2c_registerMap[i2c_registerMapIndex].writeBytes + (IS_LBLOCK?1:0) - 1 - i) = i2c_buffer[i];
+							// Unmangle byte order since SMBus sends lowest byte first - Write from end to the beginning
+							*(i2c_cmd->ramAddr + pageOffset + i2c_cmd->writeBytes + (IS_LBLOCK?1:0) - 1 - i) = i2c_buffer[i];
 #endif
+						}
 					}
 				}
 			}
 			break;
 
 		case I2C_SRX_ADR_DATA_NACK:      // Previously addressed with own SLA+W; data has been received; NOT ACK has been returned
+#ifndef I2C_NO_GENERAL_CALL
 		case I2C_SRX_GEN_DATA_NACK:      // Previously addressed with general call; data has been received; NOT ACK has been returned
+#endif
 		case I2C_STX_DATA_ACK_LAST_BYTE: // Last data byte in TWDR has been transmitted (TWEA = \930\94); ACK has been received
 //		case I2C_NO_STATE              // No relevant state information available; TWINT = \930\94
 		case I2C_BUS_ERROR:         // Bus error due to an illegal START or STOP condition
+			I2C_STATS_COUNT(busErrors);
+			I2C_STATS_END();
 			TWCR |= _BV(TWSTO) | _BV(TWINT); //Recover from I2C_BUS_ERROR, this will release the SDA and SCL pins thus enabling other devices to use the bus
 			break;
 
 		default:     
+			I2C_STATS_COUNT(unknownStates);
 			TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWEA);
       
 			i2c_busy = 0; // Unknown status, so we wait for a new address match that might be something we can handle
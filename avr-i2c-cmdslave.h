@@ -40,6 +40,8 @@ LICENSE:
 #define I2C_FREQ 400000
 #define I2C_TWBR ( ((F_CPU) / (2UL * (I2C_FREQ))) - 8UL)
 
+// Define I2C_NO_GENERAL_CALL to compile out the general call states (i2c_all_call is then ignored)
+
 typedef struct
 {
 	uint8_t cmdCode;
@@ -60,6 +62,34 @@ volatile uint8_t cmdQueueTail;
 volatile uint8_t cmdQueueFull;
 CmdBuffer cmdQueue[I2C_CMD_BUFFER_SIZE];
 
+#ifdef I2C_ENABLE_STATS
+// Slave telemetry, compiled in with I2C_ENABLE_STATS.  Times are in counts of
+// I2C_STATS_TIMER, which must be a free-running 16 bit timer set up by the application.
+// To let masters read the counters, give a read-only command ramAddr = (uint8_t*)&i2c_statsReport
+// and readBytes = sizeof(I2CSlaveStats); it's refreshed each time that command is read.
+#ifndef I2C_STATS_TIMER
+#define I2C_STATS_TIMER    TCNT1
+#endif
+
+typedef struct
+{
+	uint16_t addressMatches;    // SLA+R, SLA+W and general calls we answered
+	uint32_t bytesReceived;     // Bytes written by masters, including the command code
+	uint32_t bytesSent;
+	uint16_t overruns;          // Bytes read past the end of a command, or written past its PEC
+	uint16_t busErrors;         // Bus errors and transfers aborted part way
+	uint16_t unknownStates;     // TWI states the ISR doesn't handle
+	uint16_t pecFaults;         // Writes whose PEC byte didn't match
+	uint16_t unsupported;       // Command codes written that aren't in the table, counted once as they arrive
+	uint32_t busyTime;          // Timer counts from address match to STOP or the final NACK
+} I2CSlaveStats;
+
+extern I2CSlaveStats i2c_statsReport;
+
+void i2c_stats_snapshot(I2CSlaveStats *stats);
+void i2c_stats_reset(void);
+#endif
+
 uint8_t i2cCmdQueueDepth(void);
 uint8_t i2cCmdQueuePush(CmdBuffer* data);
 uint8_t i2cCmdQueuePop(CmdBuffer* data);
@@ -70,18 +100,88 @@ uint8_t i2cCmdQueuePop(CmdBuffer* data);
 // NVM       = Stored in NVM
 // SKIP_BYTE = Skip bytes in memory; used for byte versions of word commands (e.g. STATUS_WORD / STATUS_BYTE)
 // ASCII     = ASCII type commands
+// DIRECT    = Written straight into memory as bytes arrive, not staged until STOP.  Only for
+//             non-block commands where a partial write is harmless; PEC can't veto the write.
 // LEN       = Store length of block written in memory
 // BLOCK     = Block command
 #define I2C_PAGED              0x80
 #define I2C_NVM                0x40
 #define I2C_SKIP_BYTE          0x10
 #define I2C_ASCII              0x08
+#define I2C_DIRECT             0x04
 #define I2C_LEN                0x02
 #define I2C_BLOCK              0x01
 
+// Writes to other commands are staged in a buffer and copied into memory on STOP.  The buffer
+// is I2C_WRITE_BUFFER_SIZE bytes, which must be at least the largest writeBytes of any staged
+// (not I2C_DIRECT) command; a write to a command that doesn't fit is dropped and flagged with
+// STATUS_CML_DATA_FAULT.  Given the command list as I2C_COMMANDS (see below) it is sized from
+// that, just big enough for the largest staged command, whether the table is in flash or RAM.
+// Otherwise a RAM table needs I2C_WRITE_BUFFER_SIZE defined - there is no default, so a
+// build doesn't quietly spend more RAM than its commands need.
+#ifdef I2C_COMMAND_LIST_H
+#include I2C_COMMAND_LIST_H
+#endif
+
+#if defined(I2C_PROGMEM_COMMANDS) && !defined(I2C_COMMANDS)
+#error I2C_PROGMEM_COMMANDS needs the command list as I2C_COMMANDS, or a header defining it named by I2C_COMMAND_LIST_H
+#endif
+
+#if defined(I2C_COMMANDS) && !defined(I2C_WRITE_BUFFER_SIZE)
+#define I2C_WRITE_BUFFER_SIZE  (sizeof(union { I2C_COMMANDS(I2C_CMD_STAGE) }))
+#endif
+
+#ifndef I2C_WRITE_BUFFER_SIZE
+#error Define I2C_WRITE_BUFFER_SIZE as the largest writeBytes of any staged command, or give the command list as I2C_COMMANDS
+#endif
+
 // Defines for i2c_registerIndex
 #define I2C_UNSUPPORTED 0xFF
 
+/* Command tables in flash.  Define I2C_PROGMEM_COMMANDS (for the library and the application)
+   and describe the commands once with an X-macro list, one entry per command, named
+   I2C_COMMANDS in a header of its own:
+
+     #define I2C_COMMANDS(X) \
+         X(PAGE,        0x00, 0,         0, 1, I2C_PAGE) \
+         X(STATUS_BYTE, 0x78, I2C_PAGED, 1, 0, I2C_STATUS_WORD)
+
+   Name that header with I2C_COMMAND_LIST_H (e.g. -DI2C_COMMAND_LIST_H='"commands.h"') for
+   the library and the application, so both size the write staging buffer from it - just big
+   enough for the largest staged command.  A RAM table can use the same list just for the
+   sizing, as long as the two agree.  Then put
+
+     I2C_DEFINE_COMMAND_TABLE(I2C_COMMANDS)
+
+   in exactly one application source file.  That generates i2c_registerMap[] and the 256 byte
+   i2c_registerIndex[] in PROGMEM, and fails to compile on a duplicate or out of range code,
+   I2C_LEN or I2C_DIRECT used wrongly with I2C_BLOCK, more than 254 commands, or a list
+   with a staged command bigger than I2C_WRITE_BUFFER_SIZE.
+   i2c_command_codes_unique() is never called: it holds a switch with a case per code, so a
+   code listed twice is a duplicate case label and stops the build. */
+#define I2C_CMDIDX_ENUM(name, code, attributes, readBytes, writeBytes, ramAddr)  I2C_CMDIDX_##name,
+#define I2C_CMDIDX_ENTRY(name, code, attributes, readBytes, writeBytes, ramAddr) [(code)] = I2C_CMDIDX_##name,
+#define I2C_CMD_ENTRY(name, code, attributes, readBytes, writeBytes, ramAddr)    { (code), (attributes), (readBytes), (writeBytes), (uint8_t*)(ramAddr) },
+#define I2C_CMD_CASE(name, code, attributes, readBytes, writeBytes, ramAddr)     case (code): break;
+#define I2C_CMD_STAGE(name, code, attributes, readBytes, writeBytes, ramAddr)    uint8_t I2C_CMDBUF_##name[(((attributes) & I2C_DIRECT) || 0 == (writeBytes)) ? 1 : (writeBytes)];
+#define I2C_CMD_CHECK(name, code, attributes, readBytes, writeBytes, ramAddr) \
+	_Static_assert((code) <= 0xFF, "I2C command " #name " code out of range"); \
+	_Static_assert(!((attributes) & I2C_LEN) || ((attributes) & I2C_BLOCK), "I2C command " #name " has I2C_LEN without I2C_BLOCK"); \
+	_Static_assert(!((attributes) & I2C_DIRECT) || !((attributes) & I2C_BLOCK), "I2C command " #name " can't be both I2C_DIRECT and I2C_BLOCK"); \
+	_Static_assert((readBytes) <= 0xFF && (writeBytes) <= 0xFF, "I2C command " #name " too long");
+
+#define I2C_DEFINE_COMMAND_TABLE(list) \
+	enum { list(I2C_CMDIDX_ENUM) I2C_CMD_COUNT }; \
+	_Static_assert(I2C_CMD_COUNT < I2C_UNSUPPORTED, "Too many I2C commands"); \
+	list(I2C_CMD_CHECK) \
+	__attribute__((unused)) static inline void i2c_command_codes_unique(uint8_t code) { switch(code) { list(I2C_CMD_CASE) default: break; } } \
+	const i2cCommand i2c_registerMap[] PROGMEM = { list(I2C_CMD_ENTRY) }; \
+	_Static_assert(sizeof(union { list(I2C_CMD_STAGE) }) <= I2C_WRITE_BUFFER_SIZE, "I2C write buffer smaller than a staged command"); \
+	_Pragma("GCC diagnostic push") \
+	_Pragma("GCC diagnostic ignored \"-Woverride-init\"") \
+	const uint8_t i2c_registerIndex[256] PROGMEM = { [0 ... 255] = I2C_UNSUPPORTED, list(I2C_CMDIDX_ENTRY) }; \
+	_Pragma("GCC diagnostic pop")
+
 // Defines for i2c_state
 #define I2C_STATE_ERROR         0x01
 
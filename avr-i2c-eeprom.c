@@ -0,0 +1,196 @@
+/*************************************************************************
+Title:    MRBus AVR I2C Library - 24Cxx EEPROM Driver
+Authors:  Nathan D. Holmes <maverick@drgw.net>
+File:     avr-i2c-eeprom.c
+License:  GNU General Public License v3
+
+LICENSE:
+    Copyright (C) 2012 Nathan Holmes
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+*************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include "avr-i2c-eeprom.h"
+
+// State of the write in progress.  Pages are written from the I2C ISR's completion
+// callback, so a write runs to the end without the application's help.
+static const I2CEeprom *eeprom_dev;
+static const uint8_t *eeprom_data;
+static uint16_t eeprom_addr;
+static uint16_t eeprom_remaining;
+static uint16_t eeprom_polls;
+static volatile uint8_t eeprom_status = I2C_XFER_IDLE;
+static I2CTransaction eeprom_xfer;
+static uint8_t eeprom_buffer[2 + I2C_EEPROM_MAX_PAGE];
+
+// Slave address and word address bytes for a memory address.  Returns the number of word address bytes.
+static uint8_t i2c_eeprom_address(const I2CEeprom *dev, uint16_t addr, uint8_t *slave, uint8_t *buffer)
+{
+	if (1 == dev->addressBytes)
+	{
+		*slave = (dev->address | ((addr >> 8) & 0x07)) << 1;
+		buffer[0] = addr & 0xFF;
+		return(1);
+	}
+
+	*slave = dev->address << 1;
+	buffer[0] = addr >> 8;
+	buffer[1] = addr & 0xFF;
+	return(2);
+}
+
+// Queue the next page, or an address-only poll once all the data has gone.
+// Returns 0 if the master's queue was full.
+static uint8_t i2c_eeprom_next(void)
+{
+	uint16_t len = 0;
+	uint8_t addrLen;
+
+	addrLen = i2c_eeprom_address(eeprom_dev, eeprom_addr, &eeprom_xfer.address, eeprom_buffer);
+
+	if (eeprom_remaining)
+	{
+		// Don't cross a page boundary - the chip would wrap to the start of the page
+		len = eeprom_dev->pageSize - (eeprom_addr % eeprom_dev->pageSize);
+		if (len > eeprom_remaining)
+			len = eeprom_remaining;
+		memcpy(eeprom_buffer + addrLen, eeprom_data, len);
+		len += addrLen;
+	}
+
+	eeprom_xfer.length = len;
+	return(i2c_queue_transaction(&eeprom_xfer));
+}
+
+// Runs from the I2C ISR each time a page write or poll finishes
+static void i2c_eeprom_done(I2CTransaction *t)
+{
+	if (I2C_XFER_ADDR_NACK == t->status)
+	{
+		// Still busy with the last write cycle - ACK polling, so try again right away
+		if (++eeprom_polls > I2C_EEPROM_POLL_LIMIT)
+		{
+			eeprom_status = I2C_XFER_TIMEOUT;
+			return;
+		}
+		if (!i2c_queue_transaction(t))
+			eeprom_status = I2C_XFER_FAILED;
+		return;
+	}
+
+	if (I2C_XFER_DONE != t->status)
+	{
+		eeprom_status = t->status;
+		return;
+	}
+
+	eeprom_polls = 0;
+	if (0 == eeprom_remaining)
+	{
+		// That was the final poll, the last page is in
+		eeprom_status = I2C_XFER_DONE;
+		return;
+	}
+
+	// Page accepted, move on to the next one
+	t->length -= (1 == eeprom_dev->addressBytes) ? 1 : 2;
+	eeprom_data += t->length;
+	eeprom_addr += t->length;
+	eeprom_remaining -= t->length;
+	if (!i2c_eeprom_next())
+		eeprom_status = I2C_XFER_FAILED;
+}
+
+// eeprom_buffer holds the address bytes and one page
+static uint8_t i2c_eeprom_page_ok(const I2CEeprom *dev)
+{
+	return((0 != dev->pageSize && dev->pageSize <= I2C_EEPROM_MAX_PAGE) ? 1:0);
+}
+
+/****************************************************************************
+Call this function to start writing len bytes at addr without waiting.  The write is
+split on page boundaries, and each page is started as soon as the chip acknowledges its
+address again (ACK polling) rather than after a fixed worst-case delay.  data must stay
+valid until i2c_eeprom_status() is no longer I2C_XFER_ACTIVE.
+Returns 1 if the write was started, 0 if one is already in progress, the master's queue
+is full or dev's pageSize is 0 or larger than I2C_EEPROM_MAX_PAGE.  If the queue fills
+up part way through, the write stops with I2C_XFER_FAILED.
+****************************************************************************/
+uint8_t i2c_eeprom_write_start(const I2CEeprom *dev, uint16_t addr, const uint8_t *data, uint16_t len)
+{
+	if (I2C_XFER_ACTIVE == eeprom_status || !i2c_eeprom_page_ok(dev))
+		return(0);
+
+	eeprom_dev = dev;
+	eeprom_addr = addr;
+	eeprom_data = data;
+	eeprom_remaining = len;
+	eeprom_polls = 0;
+	eeprom_status = I2C_XFER_ACTIVE;
+
+	memset(&eeprom_xfer, 0, sizeof(eeprom_xfer));
+	eeprom_xfer.buffer = eeprom_buffer;
+	eeprom_xfer.flags = I2C_XFER_SEND_STOP;
+	eeprom_xfer.callback = i2c_eeprom_done;
+	if (!i2c_eeprom_next())
+	{
+		eeprom_status = I2C_XFER_IDLE;
+		return(0);
+	}
+	return(1);
+}
+
+/****************************************************************************
+Call this function to check on a write.  Returns I2C_XFER_ACTIVE while it is running,
+then I2C_XFER_DONE or the error that stopped it (I2C_XFER_TIMEOUT if the chip never
+came back from a write cycle).
+****************************************************************************/
+uint8_t i2c_eeprom_status(void)
+{
+	return(eeprom_status);
+}
+
+/****************************************************************************
+Call this function to write len bytes at addr and wait until the chip has finished
+its last write cycle.  Returns I2C_XFER_DONE or an error code, I2C_XFER_FAILED if dev's
+pageSize is out of range.
+****************************************************************************/
+uint8_t i2c_eeprom_write(const I2CEeprom *dev, uint16_t addr, const uint8_t *data, uint16_t len)
+{
+	if (!i2c_eeprom_page_ok(dev))
+		return(I2C_XFER_FAILED);
+	while (!i2c_eeprom_write_start(dev, addr, data, len));
+	while (I2C_XFER_ACTIVE == eeprom_status);
+	return(eeprom_status);
+}
+
+/****************************************************************************
+Call this function to read len bytes from addr as one sequential read transaction.
+Returns I2C_XFER_DONE or an error code.
+****************************************************************************/
+uint8_t i2c_eeprom_read(const I2CEeprom *dev, uint16_t addr, uint8_t *data, uint16_t len)
+{
+	I2CTransaction t;
+	uint8_t wordAddr[2];
+
+	memset(&t, 0, sizeof(t));
+	t.length = i2c_eeprom_address(dev, addr, &t.address, wordAddr);
+	t.buffer = wordAddr;
+	t.rxBuffer = data;
+	t.rxLength = len;
+	t.flags = I2C_XFER_SEND_STOP;
+	i2c_transfer(&t);
+	return(t.status);
+}
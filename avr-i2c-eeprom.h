@@ -0,0 +1,47 @@
+/*************************************************************************
+Title:    MRBus AVR I2C Library - 24Cxx EEPROM Driver
+Authors:  Nathan D. Holmes <maverick@drgw.net>
+File:     avr-i2c-eeprom.h
+License:  GNU General Public License v3
+
+LICENSE:
+    Copyright (C) 2012 Nathan Holmes
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+*************************************************************************/
+
+#ifndef _AVR_I2C_EEPROM_H
+#define _AVR_I2C_EEPROM_H
+
+#include "avr-i2c-master.h"
+
+#ifndef I2C_EEPROM_MAX_PAGE
+#define I2C_EEPROM_MAX_PAGE    64    // Largest page size of any EEPROM that will be written
+#endif
+
+#ifndef I2C_EEPROM_POLL_LIMIT
+#define I2C_EEPROM_POLL_LIMIT  500   // Address NACKs tolerated while waiting for a write cycle
+#endif
+
+typedef struct
+{
+	uint8_t address;       // 7 bit base address, usually 0x50
+	uint8_t addressBytes;  // 1 for 24C01-24C16 (upper address bits go in the slave address), 2 for 24C32 and up
+	uint8_t pageSize;      // Page size in bytes, 1 to I2C_EEPROM_MAX_PAGE - writes are refused otherwise
+} I2CEeprom;
+
+uint8_t i2c_eeprom_write_start(const I2CEeprom *dev, uint16_t addr, const uint8_t *data, uint16_t len);
+uint8_t i2c_eeprom_status(void);
+uint8_t i2c_eeprom_write(const I2CEeprom *dev, uint16_t addr, const uint8_t *data, uint16_t len);
+uint8_t i2c_eeprom_read(const I2CEeprom *dev, uint16_t addr, uint8_t *data, uint16_t len);
+
+#endif
@@ -27,43 +27,568 @@ LICENSE:
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/atomic.h>
+#include <util/delay.h>
+#include <avr/pgmspace.h>
 #include "avr-i2c-master.h"
 
-volatile uint8_t i2c_buffer[I2C_MAX_BUFFER_SIZE];    // Transceiver buffer
-uint8_t i2c_bufferLen = 0;                   // Number of bytes to be transmitted.
-volatile uint8_t i2c_bufferIdx = 0;
+#ifndef I2C_DISABLE_BUFFERED_API
+volatile uint8_t i2c_buffer[I2C_MAX_BUFFER_SIZE];    // Transceiver buffer for i2c_transmit()/i2c_receive()
+static I2CTransaction i2c_bufferedXfer;              // Transaction used to send i2c_buffer
+#endif
+uint16_t i2c_bufferLen = 0;                  // Number of data bytes in the current transaction
+volatile uint16_t i2c_bufferIdx = 0;
 volatile uint8_t i2c_state = I2C_NO_STATE;      // State byte. Default set to I2C_NO_STATE.
 volatile uint8_t i2c_status = 0;
 
+// Transaction the ISR is working on and its (caller owned) data buffer
+static I2CTransaction *i2c_current = NULL;
+static uint8_t *i2c_msgBuffer = NULL;
+
+// Clock used for transactions that don't specify one
+static I2CClock i2c_defaultClock = { I2C_TWBR, I2C_TWSR };
+
+static volatile uint8_t i2c_timeoutTicks = 0;   // Counts down over the whole transaction, 0 when not timing
+static uint8_t i2c_timeoutReload = 0;            // What i2c_timeoutTicks starts from
+static volatile uint8_t i2c_idleTicks = 0;      // Counts down between bytes, 0 when not timing
+static uint8_t i2c_idleReload = 0;               // What i2c_idleTicks restarts from on each byte
+
+// Multi-master arbitration
+static volatile uint8_t i2c_backoffTicks = 0;  // Waiting to (re)start the current transaction
+static volatile uint8_t i2c_onBus = 0;         // The current transaction's START has gone out
+static volatile uint8_t i2c_stuck = 0;         // SCL or SDA held low after an abort, waiting for i2c_recover_bus()
+static uint8_t i2c_ticking = 0;                // i2c_master_tick() has been called, so a backoff will run out
+static uint8_t i2c_arbRetries = 0;
+static uint8_t i2c_arbPriority = 0;
+static uint8_t i2c_random = 0x5A;
+
+#ifdef I2C_ENABLE_STATS
+static I2CStats i2c_stats;
+static uint16_t i2c_startTime;
+#endif
+
+// Transactions waiting for the bus, one queue per priority lane
+typedef struct
+{
+	I2CTransaction **items;
+	uint8_t depth;
+	uint8_t head;
+	uint8_t tail;
+	volatile uint8_t count;
+} I2CQueue;
+
+#define I2C_LANE_NORMAL  0
+#define I2C_LANE_URGENT  1
+
+static I2CTransaction *i2c_normalQueue[I2C_QUEUE_DEPTH];
+static I2CTransaction *i2c_urgentQueue[I2C_URGENT_QUEUE_DEPTH];
+static I2CQueue i2c_queues[2] = {
+	{ i2c_normalQueue, I2C_QUEUE_DEPTH, 0, 0, 0 },
+	{ i2c_urgentQueue, I2C_URGENT_QUEUE_DEPTH, 0, 0, 0 }
+};
+
+#ifdef I2C_ENABLE_STATS
+static uint16_t i2c_urgentQueuedTime[I2C_URGENT_QUEUE_DEPTH];
+#endif
+
+// Bulk transfers.  i2c_chunkPos is where the data of the current START begins - anything
+// before it went out before the transaction was suspended to let urgent traffic through.
+static uint16_t i2c_chunkPos = 0;
+static I2CTransaction *i2c_suspended = NULL;
+static uint16_t i2c_suspendedPos = 0;
+
+// Set up to send the current transaction from its first byte (or the start of its chunk)
+static void i2c_rewind(void)
+{
+	i2c_msgBuffer = i2c_current->buffer;
+	i2c_bufferLen = i2c_current->length;
+	if ((i2c_current->flags & I2C_XFER_BULK) && ((i2c_chunkPos + I2C_BULK_CHUNK) < i2c_bufferLen))
+		i2c_bufferLen = i2c_chunkPos + I2C_BULK_CHUNK;
+	i2c_state = I2C_NO_STATE;
+	i2c_status = (i2c_current->flags & I2C_XFER_SEND_STOP) ? _BV(I2C_MSG_SEND_STOP) : 0;
+}
+
+// Whether the current transaction may be started over after losing arbitration on the bus
+static uint8_t i2c_arb_retry(void)
+{
+#ifdef I2C_ENABLE_STREAMING
+	// The callbacks have already produced or consumed the bytes so far
+	if (NULL != i2c_current->produce || NULL != i2c_current->consume)
+		return(0);
+#endif
+	return((++i2c_arbRetries <= I2C_ARB_RETRIES) ? 1:0);
+}
+
+// Switch the bus clock before the START goes out
+static void i2c_set_bus_clock(I2CTransaction *t)
+{
+	if (t->clock.twps & I2C_CLOCK_SET)
+	{
+		TWBR = t->clock.twbr;
+		TWSR = t->clock.twps & I2C_CLOCK_PRESCALER;
+	} else {
+		TWBR = i2c_defaultClock.twbr;
+		TWSR = i2c_defaultClock.twps & I2C_CLOCK_PRESCALER;
+	}
+}
+
+static void i2c_arm_timeout(I2CTransaction *t)
+{
+	if (I2C_TIMEOUT_NONE == t->timeout)
+		i2c_timeoutReload = 0;
+	else
+		i2c_timeoutReload = t->timeout ? t->timeout : I2C_TIMEOUT_TICKS;
+	i2c_timeoutTicks = i2c_timeoutReload;
+	i2c_idleReload = t->idleTimeout;
+	i2c_idleTicks = i2c_idleReload;
+}
+
+// Count a tick against the current transaction's deadline and its limit between bytes.
+// Returns 1 if either has run out.
+static uint8_t i2c_timeout_tick(void)
+{
+	uint8_t expired = 0;
+
+	if ((0 != i2c_timeoutTicks) && (0 == --i2c_timeoutTicks))
+		expired = 1;
+	if ((0 != i2c_idleTicks) && (0 == --i2c_idleTicks))
+		expired = 1;
+	return(expired);
+}
+
+// Must be called with interrupts disabled (or from the ISR)
+static void i2c_load(I2CTransaction *t)
+{
+	i2c_current = t;
+	i2c_chunkPos = 0;
+	i2c_rewind();
+	t->status = I2C_XFER_ACTIVE;
+	i2c_arbRetries = 0;
+	i2c_onBus = 0;
+	i2c_arm_timeout(t);
+#ifdef I2C_ENABLE_STATS
+	i2c_startTime = I2C_STATS_TIMER;
+#endif
+	i2c_set_bus_clock(t);
+}
+
+// Pick a suspended bulk transfer back up where it left off
+static void i2c_resume(void)
+{
+	i2c_current = i2c_suspended;
+	i2c_suspended = NULL;
+	i2c_chunkPos = i2c_suspendedPos;
+	i2c_rewind();
+	i2c_arbRetries = 0;
+	i2c_onBus = 0;
+	i2c_arm_timeout(i2c_current);
+#ifdef I2C_ENABLE_STATS
+	i2c_startTime = I2C_STATS_TIMER;
+#endif
+	i2c_set_bus_clock(i2c_current);
+}
+
+// Park the current bulk transfer at a chunk boundary so urgent traffic can have the bus
+static void i2c_suspend(void)
+{
+#ifdef I2C_ENABLE_STATS
+	i2c_stats.busyTime += (uint16_t)(I2C_STATS_TIMER - i2c_startTime);
+#endif
+	i2c_suspended = i2c_current;
+	i2c_suspendedPos = i2c_bufferIdx;
+	i2c_current = NULL;
+}
+
+static I2CTransaction* i2c_queue_pop(uint8_t lane)
+{
+	I2CQueue *q = &i2c_queues[lane];
+	I2CTransaction *t = q->items[q->tail];
+
+#ifdef I2C_ENABLE_STATS
+	if (I2C_LANE_URGENT == lane)
+	{
+		uint16_t wait = I2C_STATS_TIMER - i2c_urgentQueuedTime[q->tail];
+		if (wait > i2c_stats.urgentWaitMax)
+			i2c_stats.urgentWaitMax = wait;
+	}
+#endif
+	if (++q->tail >= q->depth)
+		q->tail = 0;
+	q->count--;
+	return(t);
+}
+
+#ifdef I2C_ENABLE_STATS
+static void i2c_stats_result(uint8_t address, uint8_t result)
+{
+	I2CDeviceStats *dev = NULL;
+	uint8_t i;
+
+	i2c_stats.busyTime += (uint16_t)(I2C_STATS_TIMER - i2c_startTime);
+	if (result < I2C_XFER_RESULTS)
+		i2c_stats.results[result]++;
+
+	for (i=0; i<I2C_STATS_DEVICES; i++)
+	{
+		if (i2c_stats.devices[i].address == address)
+		{
+			dev = &i2c_stats.devices[i];
+			break;
+		}
+		if ((NULL == dev) && (0 == i2c_stats.devices[i].address))
+			dev = &i2c_stats.devices[i];
+	}
+
+	if (NULL == dev)
+		return;   // Table full, only the totals count this one
+
+	dev->address = address;
+	if (I2C_XFER_DONE == result)
+		dev->success++;
+	else
+		dev->failure++;
+}
+#endif
+
+// Hand the result of the current transaction back to its owner
+static void i2c_finish(uint8_t result)
+{
+	I2CTransaction *t = i2c_current;
+
+	if (NULL == t)
+		return;
+
+	i2c_current = NULL;
+	t->status = result;
+#ifdef I2C_ENABLE_STATS
+	i2c_stats_result(t->address >> 1, result);
+#endif
+	if (NULL != t->callback)
+		t->callback(t);
+}
+
+// Load the next queued transaction, if any, and return the TWCR value to write.  twcr is
+// what ends the current transaction; a (repeated) START is added if there's more to do.
+// Urgent transactions go first, then a suspended bulk transfer, then the normal lane.
+static uint8_t i2c_next(uint8_t twcr)
+{
+	if (0 != i2c_queues[I2C_LANE_URGENT].count)
+		i2c_load(i2c_queue_pop(I2C_LANE_URGENT));
+	else if (NULL != i2c_suspended)
+		i2c_resume();
+	else if (0 != i2c_queues[I2C_LANE_NORMAL].count)
+		i2c_load(i2c_queue_pop(I2C_LANE_NORMAL));
+	else
+		return(twcr);
+
+	return(twcr | _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWSTA));
+}
+
+#if I2C_ARB_BACKOFF_TICKS > 0
+// One look at the lines - another master is mid-transaction if SCL or SDA is low.  A STOP
+// of our own that is still going out would look like traffic, but the bus is ours until it
+// has, and the TWI holds a START back until it's done, so that counts as idle.  No waiting,
+// and interrupts are left as they are: this runs inside callers' atomic blocks and from
+// the timer tick, so a bus that isn't idle is looked at again on a later tick.
+static uint8_t i2c_bus_idle(void)
+{
+	if (TWCR & _BV(TWSTO))
+		return(1);
+	return(((I2C_SCL_PIN & _BV(I2C_SCL)) && (I2C_SDA_PIN & _BV(I2C_SDA))) ? 1:0);
+}
+#endif
+
+// Fail the current transaction with I2C_XFER_ARB_LOST when it ran out of retries without
+// ever getting on the bus.  Another master has it, so there's nothing of ours to recover;
+// a pending START is withdrawn.  Returns 1 if the next transaction was loaded and needs a START.
+static uint8_t i2c_arb_give_up(void)
+{
+	i2c_backoffTicks = 0;
+	// Look busy while the callback runs, as in i2c_abort()
+	TWCR = _BV(TWEN) | _BV(TWIE);
+	i2c_finish(I2C_XFER_ARB_LOST);
+	TWCR = _BV(TWEN);
+	i2c_next(0);
+	return((NULL != i2c_current) ? 1:0);
+}
+
+#if I2C_ARB_BACKOFF_TICKS > 0
+static uint8_t i2c_backoff(void);
+#endif
+
+// START the current transaction, unless another master is using the bus - then back off
+// and look again when the backoff runs out, which counts against I2C_ARB_RETRIES.  No check is needed while we still
+// hold the bus after a no-STOP transaction, and none is made until i2c_master_tick() is
+// running, since nothing would retry the START; the TWI then waits for the other master's STOP itself.
+static void i2c_claim_bus(void)
+{
+#if I2C_ARB_BACKOFF_TICKS > 0
+	uint8_t holdingBus = (TWCR & _BV(TWINT)) && ((TWSR & 0xF8) == I2C_MTX_DATA_ACK || (TWSR & 0xF8) == I2C_MTX_ADR_ACK);
+
+	while (i2c_ticking && !holdingBus && !i2c_bus_idle())
+	{
+		if (++i2c_arbRetries <= I2C_ARB_RETRIES)
+		{
+			i2c_backoffTicks = i2c_backoff();
+			return;
+		}
+		if (!i2c_arb_give_up())
+			return;
+	}
+#endif
+	TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWSTA);
+}
+
+#if I2C_ARB_BACKOFF_TICKS > 0
+// Ticks to wait after losing arbitration - random within a window that doubles with
+// each retry, pushed back one window per priority level so the more urgent master wins.
+// Worked in 16 bits and clamped, since i2c_backoffTicks is only 8.
+static uint8_t i2c_backoff(void)
+{
+	uint16_t window = (uint16_t)(I2C_ARB_BACKOFF_TICKS) << ((i2c_arbRetries < 4) ? i2c_arbRetries : 4);
+	uint16_t ticks;
+
+	i2c_random = (i2c_random >> 1) ^ ((i2c_random & 0x01) ? 0xB8 : 0x00);
+	ticks = window * i2c_arbPriority + (i2c_random % window) + 1;
+	return((ticks > 0xFF) ? 0xFF : ticks);
+}
+#endif
+
+#ifdef I2C_ENABLE_PEC
+// SMBus CRC-8 (x^8 + x^2 + x + 1) table stored in flash.
+static const uint8_t i2c_crcTable[256] PROGMEM = {
+	0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15,
+	0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d,
+	0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65,
+	0x48, 0x4f, 0x46, 0x41, 0x54, 0x53, 0x5a, 0x5d,
+	0xe0, 0xe7, 0xee, 0xe9, 0xfc, 0xfb, 0xf2, 0xf5,
+	0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd,
+	0x90, 0x97, 0x9e, 0x99, 0x8c, 0x8b, 0x82, 0x85,
+	0xa8, 0xaf, 0xa6, 0xa1, 0xb4, 0xb3, 0xba, 0xbd,
+	0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2,
+	0xff, 0xf8, 0xf1, 0xf6, 0xe3, 0xe4, 0xed, 0xea,
+	0xb7, 0xb0, 0xb9, 0xbe, 0xab, 0xac, 0xa5, 0xa2,
+	0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a,
+	0x27, 0x20, 0x29, 0x2e, 0x3b, 0x3c, 0x35, 0x32,
+	0x1f, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0d, 0x0a,
+	0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42,
+	0x6f, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7d, 0x7a,
+	0x89, 0x8e, 0x87, 0x80, 0x95, 0x92, 0x9b, 0x9c,
+	0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4,
+	0xf9, 0xfe, 0xf7, 0xf0, 0xe5, 0xe2, 0xeb, 0xec,
+	0xc1, 0xc6, 0xcf, 0xc8, 0xdd, 0xda, 0xd3, 0xd4,
+	0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c,
+	0x51, 0x56, 0x5f, 0x58, 0x4d, 0x4a, 0x43, 0x44,
+	0x19, 0x1e, 0x17, 0x10, 0x05, 0x02, 0x0b, 0x0c,
+	0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34,
+	0x4e, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5c, 0x5b,
+	0x76, 0x71, 0x78, 0x7f, 0x6a, 0x6d, 0x64, 0x63,
+	0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b,
+	0x06, 0x01, 0x08, 0x0f, 0x1a, 0x1d, 0x14, 0x13,
+	0xae, 0xa9, 0xa0, 0xa7, 0xb2, 0xb5, 0xbc, 0xbb,
+	0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8d, 0x84, 0x83,
+	0xde, 0xd9, 0xd0, 0xd7, 0xc2, 0xc5, 0xcc, 0xcb,
+	0xe6, 0xe1, 0xe8, 0xef, 0xfa, 0xfd, 0xf4, 0xf3
+};
+
+static uint8_t i2c_pec;
+
+// PEC covers every byte on the wire, addresses included, from the first START
+#define I2C_PEC_UPDATE(data)  (i2c_pec = pgm_read_byte(&i2c_crcTable[i2c_pec ^ (data)]))
+#define I2C_PEC_BYTES         ((i2c_current->flags & I2C_XFER_PEC) ? 1 : 0)
+#else
+#define I2C_PEC_UPDATE(data)
+#define I2C_PEC_BYTES         0
+#endif
+
+// Store a received byte.  The first byte of an SMBus block read is the count, which sets
+// where the read ends; the byte after the data is the PEC, which is checked, not stored.
+static void i2c_store(uint8_t data)
+{
+#ifdef I2C_ENABLE_STATS
+	i2c_stats.bytesReceived++;
+#endif
+
+	if (i2c_bufferIdx < i2c_bufferLen)
+	{
+		if ((0 == i2c_bufferIdx) && (i2c_current->flags & I2C_XFER_BLOCK))
+		{
+			// A count of 0 leaves just the PEC, or nothing, so the very next byte is NACKed
+			if (data < i2c_bufferLen)
+				i2c_bufferLen = data + 1;
+			else
+				i2c_status |= _BV(I2C_MSG_BLOCK_OVERFLOW);
+		}
+#ifdef I2C_ENABLE_STREAMING
+		if (NULL != i2c_current->consume)
+			i2c_current->consume(i2c_current, data);
+		else
+#endif
+		i2c_msgBuffer[i2c_bufferIdx] = data;
+		I2C_PEC_UPDATE(data);
+	}
+#ifdef I2C_ENABLE_PEC
+	else if ((i2c_bufferIdx == i2c_bufferLen) && (i2c_current->flags & I2C_XFER_PEC))
+	{
+		if (data != i2c_pec)
+			i2c_status |= _BV(I2C_MSG_PEC_BAD);
+	}
+#endif
+	i2c_bufferIdx++;
+}
+
+// Fail everything still waiting for the bus with result
+static void i2c_flush(uint8_t result)
+{
+	if (NULL != i2c_suspended)
+	{
+		i2c_current = i2c_suspended;
+		i2c_suspended = NULL;
+		i2c_finish(result);
+	}
+	while (0 != i2c_queues[I2C_LANE_URGENT].count)
+	{
+		i2c_current = i2c_queue_pop(I2C_LANE_URGENT);
+#ifdef I2C_ENABLE_STATS
+		i2c_startTime = I2C_STATS_TIMER;   // Never got the bus, so it adds no busy time
+#endif
+		i2c_finish(result);
+	}
+	while (0 != i2c_queues[I2C_LANE_NORMAL].count)
+	{
+		i2c_current = i2c_queue_pop(I2C_LANE_NORMAL);
+#ifdef I2C_ENABLE_STATS
+		i2c_startTime = I2C_STATS_TIMER;
+#endif
+		i2c_finish(result);
+	}
+}
+
+// Give up on the current transaction.  Resetting the TWI lets go of anything it was
+// driving, which is all a bus error or a slave that stopped answering needs, and the queue
+// carries on.  Clocking out a slave that still holds a line low takes ~100us of bit banging,
+// too long for an interrupt, so then the queue is failed with I2C_XFER_BUS_STUCK and nothing
+// more is accepted until i2c_recover_bus() has run from main line code.
+static void i2c_abort(uint8_t result)
+{
+	i2c_backoffTicks = 0;
+	TWCR = 0;
+	_delay_us(2);   // Let the lines rise
+	if (!(I2C_SCL_PIN & _BV(I2C_SCL)) || !(I2C_SDA_PIN & _BV(I2C_SDA)))
+	{
+		result = I2C_XFER_BUS_STUCK;
+		i2c_stuck = 1;
+	}
+
+	// Look busy while the callback runs, as on normal completion, so anything it queues
+	// waits for i2c_next() below instead of starting on its own.  TWINT is clear, so
+	// setting TWIE doesn't fire the ISR.
+	TWCR = _BV(TWEN) | _BV(TWIE);
+	i2c_finish(result);
+	if (i2c_stuck)
+	{
+		i2c_flush(I2C_XFER_BUS_STUCK);
+		TWCR = _BV(TWEN);
+	}
+	else
+		TWCR = i2c_next(_BV(TWEN));
+}
+
 ISR(I2C_vect)
 {
+#ifdef I2C_ENABLE_STATS
+	uint16_t isrStart = I2C_STATS_TIMER;
+	uint16_t isrTime;
+	I2C_STATS_STATE(&i2c_stats, TWSR & 0xF8)++;
+#endif
+
+	// The bus moved, so the limit between bytes starts over - the deadline doesn't
+	i2c_idleTicks = i2c_idleReload;
+	i2c_onBus = 1;
+
 	switch (TWSR & 0xFC)
 	{
 		case I2C_START:             // START has been transmitted  
+#ifdef I2C_ENABLE_PEC
+			i2c_pec = 0;
+#endif
+			// Fall through
 		case I2C_REP_START:         // Repeated START has been transmitted
-			i2c_bufferIdx = 0;       // Set buffer pointer to the TWI Address location
+			i2c_bufferIdx = 0;       // Set buffer pointer to the first data byte
+			TWDR = i2c_current->address | ((i2c_status & _BV(I2C_MSG_READ_PHASE)) ? _BV(I2C_READ_BIT) : 0);
+			I2C_PEC_UPDATE(TWDR);
+			TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT);
+			break;
+
 		case I2C_MTX_ADR_ACK:       // SLA+W has been tramsmitted and ACK received
 		case I2C_MTX_DATA_ACK:      // Data byte has been tramsmitted and ACK received
+			if (i2c_current->flags & I2C_XFER_BULK)
+			{
+				// A resumed bulk transfer sends its prefix again, then skips to where it left off
+				if ((i2c_bufferIdx == i2c_current->prefix) && (i2c_chunkPos > i2c_bufferIdx))
+					i2c_bufferIdx = i2c_chunkPos;
+
+				// At a chunk boundary, carry straight on unless urgent traffic is waiting
+				if ((i2c_bufferIdx == i2c_bufferLen) && (i2c_bufferLen < i2c_current->length))
+				{
+					if (0 != i2c_queues[I2C_LANE_URGENT].count)
+					{
+						i2c_suspend();
+						TWCR = i2c_next(_BV(TWEN) | _BV(TWINT) | _BV(TWSTO));
+						break;
+					}
+					i2c_bufferLen = ((i2c_current->length - i2c_bufferLen) > I2C_BULK_CHUNK) ? (i2c_bufferLen + I2C_BULK_CHUNK) : i2c_current->length;
+				}
+			}
+
 			if (i2c_bufferIdx < i2c_bufferLen)
 			{
-				TWDR = i2c_buffer[i2c_bufferIdx++];
+#ifdef I2C_ENABLE_STREAMING
+				if (NULL != i2c_current->produce)
+					TWDR = i2c_current->produce(i2c_current);
+				else
+#endif
+				if (i2c_current->flags & I2C_XFER_PROGMEM)
+					TWDR = pgm_read_byte(&i2c_msgBuffer[i2c_bufferIdx]);
+				else
+					TWDR = i2c_msgBuffer[i2c_bufferIdx];
+				i2c_bufferIdx++;
+				I2C_PEC_UPDATE(TWDR);
+#ifdef I2C_ENABLE_STATS
+				i2c_stats.bytesSent++;
+#endif
 				// TWI Interface enabled, enable TWI Interupt and clear the flag to send byte
 				TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT);    
+			} else if (0 != i2c_current->rxLength) {
+				// Write half of a write-then-read is done, turn the bus around with a repeated START
+				i2c_status |= _BV(I2C_MSG_READ_PHASE);
+				i2c_msgBuffer = i2c_current->rxBuffer;
+				i2c_bufferLen = i2c_current->rxLength;
+				TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWSTA);
+#ifdef I2C_ENABLE_PEC
+			} else if ((i2c_bufferIdx == i2c_bufferLen) && (i2c_current->flags & I2C_XFER_PEC)) {
+				// Data is done, finish with the PEC
+				TWDR = i2c_pec;
+				i2c_bufferIdx++;
+				TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT);
+#endif
 			} else {                    // Send STOP after last byte
 				i2c_status |= _BV(I2C_MSG_RECV_GOOD);
+				i2c_finish(I2C_XFER_DONE);
 				// TWI Interface enabled, disable TWI Interrupt and clear the flag, send stop (if requested)
+				// If another transaction is queued, start it (a repeated START if there was no stop)
 				if (i2c_status & _BV(I2C_MSG_SEND_STOP))
-					TWCR = _BV(TWEN) | _BV(TWINT) | _BV(TWSTO);
+					TWCR = i2c_next(_BV(TWEN) | _BV(TWINT) | _BV(TWSTO));
 				else
-					TWCR = _BV(TWEN);
+					TWCR = i2c_next(_BV(TWEN));
 			}
 			break;
 
 		case I2C_MRX_DATA_ACK:      // Data byte has been received and ACK tramsmitted
-			i2c_buffer[i2c_bufferIdx++] = TWDR;
+			i2c_store(TWDR);
+			// Fall through
 		case I2C_MRX_ADR_ACK:       // SLA+R has been tramsmitted and ACK received
-			// Detect the last byte to NACK it.
-			if (i2c_bufferIdx < (i2c_bufferLen-1) )
+			// Detect the last byte (the PEC, if there is one) to NACK it.
+			if ((i2c_bufferIdx + 1) < (i2c_bufferLen + I2C_PEC_BYTES))
 			{
 				// TWI Interface enabled, enable TWI Interupt and clear the flag to read next byte, send ACK after reception
 				TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWEA);  
@@ -75,54 +600,128 @@ ISR(I2C_vect)
 
 
 		case I2C_MRX_DATA_NACK:     // Data byte has been received and NACK tramsmitted
-			i2c_buffer[i2c_bufferIdx] = TWDR;
-			i2c_status |= _BV(I2C_MSG_RECV_GOOD);               // Set status bits to completed successfully. 
+			i2c_store(TWDR);
+			if (i2c_status & _BV(I2C_MSG_BLOCK_OVERFLOW))
+			{
+				i2c_finish(I2C_XFER_BLOCK_SIZE);
+			} else if (i2c_status & _BV(I2C_MSG_PEC_BAD)) {
+				i2c_finish(I2C_XFER_PEC_ERROR);
+			} else {
+				i2c_status |= _BV(I2C_MSG_RECV_GOOD);               // Set status bits to completed successfully. 
+				i2c_finish(I2C_XFER_DONE);
+			}
 			// TWI Interface enabled, disable TWI Interrupt and clear the flag, initiate stop
-			TWCR = _BV(TWEN) | _BV(TWINT) | _BV(TWSTO);
+			TWCR = i2c_next(_BV(TWEN) | _BV(TWINT) | _BV(TWSTO));
 			break;      
 
+		case I2C_SRX_ADR_ACK_M_ARB_LOST:  // Arbitration lost in SLA+R/W as Master; own SLA+W has been received; ACK has been returned
+		case I2C_SRX_GEN_ACK_M_ARB_LOST:  // Arbitration lost in SLA+R/W as Master; General call address has been received; ACK has been returned
+		case I2C_STX_ADR_ACK_M_ARB_LOST:  // Arbitration lost in SLA+R/W as Master; own SLA+R has been received; ACK has been returned
+			// The master that won addressed us.  We're no slave, so NACK what it writes, or give
+			// it 0xFF as the last byte it reads, and wait for it to let go of us
+			i2c_onBus = 0;
+			TWDR = 0xFF;
+			TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT);
+			break;
+
+		case I2C_SRX_ADR_DATA_NACK:       // Previously addressed with own SLA+W; data has been received; NOT ACK has been returned
+		case I2C_SRX_GEN_DATA_NACK:       // Previously addressed with general call; data has been received; NOT ACK has been returned
+		case I2C_STX_DATA_NACK:           // Data byte in TWDR has been transmitted; NOT ACK has been received
+		case I2C_STX_DATA_ACK_LAST_BYTE:  // Last data byte in TWDR has been transmitted (TWEA = 0); ACK has been received
+			// Done being addressed by the master that won - our own transaction lost arbitration
+			// Fall through
 		case I2C_ARB_LOST:          // Arbitration lost
+			i2c_state = TWSR & 0xFC;
+			i2c_onBus = 0;
+			if (!i2c_arb_retry())
+			{
+				i2c_finish(I2C_XFER_ARB_LOST);
+				// Leave the bus to the other master, the next transaction STARTs once it's free
+				TWCR = i2c_next(_BV(TWEN) | _BV(TWINT));
+				break;
+			}
+
+			// Start over from the first byte
+			i2c_rewind();
+#if I2C_ARB_BACKOFF_TICKS > 0
+			if (i2c_ticking)
+			{
+				// Release the bus and try again once the backoff runs out
+				i2c_backoffTicks = i2c_backoff();
+				TWCR = _BV(TWEN) | _BV(TWINT);
+				break;
+			}
+#endif
 			// TWI Interface enabled, Enable TWI Interupt and clear the flag, Initiate a (RE)START condition.
 			TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWSTA);
 			break;
 
 		case I2C_MTX_ADR_NACK:      // SLA+W has been tramsmitted and NACK received
 		case I2C_MRX_ADR_NACK:      // SLA+R has been tramsmitted and NACK received    
-		case I2C_MTX_DATA_NACK:     // Data byte has been tramsmitted and NACK received
 			// Store TWSR and automatically sets clears noErrors bit.
 			i2c_state = TWSR & 0xFC;
+			i2c_finish(I2C_XFER_ADDR_NACK);
 			// Send stop to clear things out since slave NACK'd
-			TWCR = _BV(TWEN) | _BV(TWINT) | _BV(TWSTO);
+			TWCR = i2c_next(_BV(TWEN) | _BV(TWINT) | _BV(TWSTO));
+			break;      
+
+		case I2C_MTX_DATA_NACK:     // Data byte has been tramsmitted and NACK received
+			i2c_state = TWSR & 0xFC;
+			i2c_finish(I2C_XFER_DATA_NACK);
+			TWCR = i2c_next(_BV(TWEN) | _BV(TWINT) | _BV(TWSTO));
 			break;      
+
 		case I2C_BUS_ERROR:         // Bus error due to an illegal START or STOP condition
+			i2c_state = TWSR & 0xFC;
+			// Reset the TWI Interface, which releases the bus
+			i2c_abort(I2C_XFER_BUS_ERROR);
+			break;
+
 		case I2C_NO_STATE:          // No relevant state information available; TWINT
 		default:     
 			// Store TWSR and automatically sets clears noErrors bit.
 			i2c_state = TWSR & 0xFC;
-			// Reset TWI Interface
-			TWCR = _BV(TWEN);
+			i2c_abort(I2C_XFER_FAILED);
 			break;
 	}
+
+#ifdef I2C_ENABLE_STATS
+	isrTime = I2C_STATS_TIMER - isrStart;
+	i2c_stats.isrTime += isrTime;
+	if (isrTime > i2c_stats.isrMax)
+		i2c_stats.isrMax = isrTime;
+#endif
 }
 
 void i2c_master_init(void)
 {
 	i2c_status = 0;
 	i2c_state = I2C_NO_STATE;
-	TWBR = I2C_TWBR;                                  // Set bit rate register (Baudrate). Defined in header file.
-	TWSR = I2C_TWSR;                                  // Prescaler
+	i2c_current = NULL;
+	i2c_suspended = NULL;
+	i2c_queues[I2C_LANE_NORMAL].head = i2c_queues[I2C_LANE_NORMAL].tail = i2c_queues[I2C_LANE_NORMAL].count = 0;
+	i2c_queues[I2C_LANE_URGENT].head = i2c_queues[I2C_LANE_URGENT].tail = i2c_queues[I2C_LANE_URGENT].count = 0;
+	i2c_backoffTicks = 0;
+	TWBR = i2c_defaultClock.twbr;                     // Set bit rate register (Baudrate). Defined in header file.
+	TWSR = i2c_defaultClock.twps & I2C_CLOCK_PRESCALER; // Prescaler
 	TWDR = 0xFF;                                      // Default content = SDA released.
 	TWCR = _BV(TWEN);
 }    
 
 uint8_t i2c_busy(void)
 {
-	return( TWCR & (_BV(TWIE)) );
+	return( (TWCR & (_BV(TWIE))) || i2c_backoffTicks );
 }
 
+#ifndef I2C_DISABLE_BUFFERED_API
+/****************************************************************************
+Call this function to find out whether the last i2c_transmit() completed. This is
+the buffered transaction's own status, so transactions queued after it don't change
+the answer.
+****************************************************************************/
 uint8_t i2c_transaction_successful()
 {
-	return((i2c_status & (_BV(I2C_MSG_RECV_GOOD))) ? 1:0);
+	return((I2C_XFER_DONE == i2c_bufferedXfer.status) ? 1:0);
 }
 
 /****************************************************************************
@@ -131,42 +730,370 @@ read/write bit. Consecutive bytes contain the data to be sent, or empty location
 from the slave. Also include how many bytes that should be sent/read including the address byte.
 The function will hold execution (loop) until the TWI_ISR has completed with the previous operation,
 then initialize the next operation and return.
+
+This is a compatibility layer over the transaction queue that copies the message into i2c_buffer.
+New code should use i2c_queue_transaction() or i2c_transfer() with its own buffer instead.
 ****************************************************************************/
 void i2c_transmit(uint8_t *msgBuffer, uint8_t msgLen, uint8_t sendStop)
 {
 	// Wait until I2C isn't busy
 	while ( i2c_busy() );             
+	if (i2c_bus_stuck())
+		i2c_recover_bus();
 
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		// Number of data bytes to transmit
-		i2c_bufferLen = msgLen;
 		i2c_buffer[0] = msgBuffer[0];  // Destination slave address with R/W bit
 
-
 		if (!(i2c_buffer[0] & (_BV(I2C_READ_BIT))))  // If it's a write, copy the rest of the bytes
 			memcpy((uint8_t*)i2c_buffer+1, msgBuffer+1, msgLen-1);
 
-		i2c_state = I2C_NO_STATE;
-		i2c_status = 0;
-		if (sendStop)
-			i2c_status |= _BV(I2C_MSG_SEND_STOP);
+		i2c_bufferedXfer.address = i2c_buffer[0];
+		i2c_bufferedXfer.buffer = (uint8_t*)i2c_buffer+1;
+		i2c_bufferedXfer.length = msgLen-1;
+		i2c_bufferedXfer.rxLength = 0;
+		i2c_bufferedXfer.flags = sendStop ? I2C_XFER_SEND_STOP : 0;
+		i2c_bufferedXfer.callback = NULL;
+		if (!i2c_queue_transaction(&i2c_bufferedXfer))
+			i2c_bufferedXfer.status = I2C_XFER_BUS_STUCK;
 	}
-	// Enable interrupts and issue a start condition
-	TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWSTA);
 }
 
 uint8_t i2c_receive(uint8_t *msgBuffer, uint8_t msgLen)
 {
 	// Wait until I2C isn't busy
 	while ( i2c_busy() );
+	if (I2C_XFER_DONE != i2c_bufferedXfer.status)
+		return(0);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		memcpy(msgBuffer, (uint8_t*)i2c_buffer, msgLen);
+	}
+
+	return(1);
+}
+#endif
+
+// A bulk write can be preempted and resumed part way, which only works for plain
+// buffered data with nothing to read back.  It can't be urgent as well - an urgent bulk
+// transfer could itself be preempted while a normal one is parked, and there is only
+// room to park one.
+static uint8_t i2c_xfer_valid(I2CTransaction *t)
+{
+	if (!(t->flags & I2C_XFER_BULK))
+		return(1);
+	if (t->flags & I2C_XFER_URGENT)
+		return(0);
+#ifdef I2C_ENABLE_STREAMING
+	if (NULL != t->produce)
+		return(0);
+#endif
+	return(((t->flags & I2C_XFER_PEC) || 0 != t->rxLength) ? 0:1);
+}
+
+/****************************************************************************
+Call this function to queue a transaction without waiting for the bus. The ISR works
+through the queue in order, starting each transaction as soon as the previous one
+finishes, so a whole burst of reads and writes to several devices can be queued at once.
+When a transaction completes its status is set to I2C_XFER_DONE or an error code and
+its callback (if any) is called from the ISR.  The callback may queue further transactions.
+Data is sent from and received straight into the transaction's buffer, so neither the
+transaction nor its buffer may be touched until it has completed.
+Transactions flagged I2C_XFER_URGENT go in a separate lane that is served first, and may
+cut into an I2C_XFER_BULK transfer at the next chunk boundary.
+Returns 1 if the transaction was queued, 0 if its lane is full, the bus is stuck (see
+i2c_bus_stuck()) or it is an I2C_XFER_BULK
+transaction that is also I2C_XFER_URGENT, or has PEC, a read phase or a produce callback.
+****************************************************************************/
+uint8_t i2c_queue_transaction(I2CTransaction *t)
+{
+	uint8_t result = 0;
+	uint8_t lane = (t->flags & I2C_XFER_URGENT) ? I2C_LANE_URGENT : I2C_LANE_NORMAL;
+	I2CQueue *q = &i2c_queues[lane];
+
+	if (!i2c_xfer_valid(t))
+		return(0);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (!i2c_stuck && q->count < q->depth)
+		{
+			t->status = I2C_XFER_QUEUED;
+#ifdef I2C_ENABLE_STATS
+			if (I2C_LANE_URGENT == lane)
+				i2c_urgentQueuedTime[q->head] = I2C_STATS_TIMER;
+#endif
+			q->items[q->head] = t;
+			if (++q->head >= q->depth)
+				q->head = 0;
+			q->count++;
+			result = 1;
+
+			// If the bus is idle, nothing will pick this up from the ISR, so start it now
+			if (!i2c_busy())
+			{
+				i2c_next(0);
+				i2c_claim_bus();
+			}
+		}
+	}
+	return(result);
+}
+
+uint8_t i2c_queue_depth(void)
+{
+	return(i2c_queues[I2C_LANE_NORMAL].count + i2c_queues[I2C_LANE_URGENT].count);
+}
+
+/****************************************************************************
+Call this function to run a transaction and wait for it to complete.  Returns 1 if
+the transaction succeeded, 0 if it failed or i2c_queue_transaction() would refuse it.
+It runs from main line code, so it recovers a stuck bus itself; if that fails the
+transaction fails with I2C_XFER_BUS_STUCK.
+****************************************************************************/
+uint8_t i2c_transfer(I2CTransaction *t)
+{
+	if (!i2c_xfer_valid(t))
+		return(0);
+	while (!i2c_queue_transaction(t))
+	{
+		if (i2c_bus_stuck() && !i2c_recover_bus())
+		{
+			t->status = I2C_XFER_BUS_STUCK;
+			return(0);
+		}
+	}
+	while (!I2C_XFER_COMPLETE(t->status));
+	return((I2C_XFER_DONE == t->status) ? 1:0);
+}
+
+/****************************************************************************
+Call this function to read len bytes starting at register reg of the slave at
+address (7 bit) as a single write-then-read transaction, waiting for it to complete.
+Returns 1 if the read succeeded, 0 if it failed.
+****************************************************************************/
+uint8_t i2c_read_register(uint8_t address, uint8_t reg, uint8_t *data, uint8_t len)
+{
+	I2CTransaction t;
+
+	memset(&t, 0, sizeof(t));
+	t.address = address << 1;
+	t.buffer = &reg;
+	t.length = 1;
+	t.rxBuffer = data;
+	t.rxLength = len;
+	t.flags = I2C_XFER_SEND_STOP;
+	return(i2c_transfer(&t));
+}
+
+/****************************************************************************
+Call this function to work out the TWBR and prescaler settings for a bus clock of freq Hz.
+SCL = F_CPU / (16 + 2 * TWBR * 4^prescaler).  The smallest prescaler that fits is used and
+the result is rounded so the bus never runs faster than requested.
+Returns I2C_CLOCK_OK, or I2C_CLOCK_TOO_FAST/I2C_CLOCK_TOO_SLOW if freq can't be generated,
+in which case clock is left untouched.
+****************************************************************************/
+uint8_t i2c_calculate_clock(uint32_t freq, I2CClock *clock)
+{
+	uint32_t div;
+	uint8_t twps;
+
+	if (0 == freq)
+		return(I2C_CLOCK_TOO_SLOW);
+
+	div = ((F_CPU) + freq - 1) / freq;
+	// TWBR = 0 is the fastest clock available, F_CPU / 16
+	if (div < 16)
+		return(I2C_CLOCK_TOO_FAST);
+
+	div = (div - 16 + 1) / 2;   // TWBR * 4^prescaler
+	for (twps = 0; twps < 4; twps++)
+	{
+		if (div <= 255)
+		{
+			clock->twbr = div;
+			clock->twps = twps | I2C_CLOCK_SET;
+			return(I2C_CLOCK_OK);
+		}
+		div = (div + 3) / 4;
+	}
+	return(I2C_CLOCK_TOO_SLOW);
+}
+
+/****************************************************************************
+Call this function to change the bus clock used by transactions that don't carry their own.
+It takes effect from the next transaction.  Returns the i2c_calculate_clock() result.
+****************************************************************************/
+uint8_t i2c_set_clock(uint32_t freq)
+{
+	I2CClock clock;
+	uint8_t result = i2c_calculate_clock(freq, &clock);
+
+	if (I2C_CLOCK_OK == result)
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			i2c_defaultClock = clock;
+		}
+	}
+	return(result);
+}
+
+/****************************************************************************
+Call this function to find the bus clock in Hz that clock gives, or that the bus default
+gives if clock wasn't set by i2c_calculate_clock().
+****************************************************************************/
+uint32_t i2c_clock_frequency(const I2CClock *clock)
+{
+	I2CClock c;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		c = (clock->twps & I2C_CLOCK_SET) ? *clock : i2c_defaultClock;
+	}
+	return((F_CPU) / (16UL + 2UL * ((uint32_t)c.twbr << (2 * (c.twps & I2C_CLOCK_PRESCALER)))));
+}
+
+/****************************************************************************
+Call this function at a fixed rate, typically from a timer interrupt, to bound how long a
+transaction can hold the bus.  A transaction still running after its timeout (in calls to
+this function), or that goes its idleTimeout without moving a byte, is aborted with
+I2C_XFER_TIMEOUT, the TWI is reset and the queue carries on (unless a line is still held
+low - see i2c_bus_stuck()).  Time spent backing
+off doesn't count, and a START still waiting for another master to finish is never
+recovered: each timeout it waits is one arbitration retry, then it fails with I2C_XFER_ARB_LOST.
+A START that has completed but whose interrupt hasn't run yet is left to the ISR.
+Without it a slave stretching SCL forever leaves the bus busy for good.  It also runs
+the arbitration backoff and retries a START that was held off by another master.
+****************************************************************************/
+void i2c_master_tick(void)
+{
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		if (i2c_status & (_BV(I2C_MSG_RECV_GOOD)))
-			memcpy(msgBuffer, (uint8_t*)i2c_buffer, msgLen);
+		i2c_ticking = 1;
+		if ((0 != i2c_backoffTicks) && (0 == --i2c_backoffTicks))
+			i2c_claim_bus();
+
+		if (0 != i2c_backoffTicks)
+		{
+			// Waiting to START, so nothing has stalled yet
+			i2c_timeoutTicks = i2c_timeoutReload;
+			i2c_idleTicks = i2c_idleReload;
+		}
+		else if (i2c_busy() && (NULL != i2c_current) && i2c_timeout_tick())
+		{
+			if (i2c_onBus)
+				i2c_abort(I2C_XFER_TIMEOUT);
+			else if ((TWCR & _BV(TWINT)) && ((TWSR & 0xF8) == I2C_START || (TWSR & 0xF8) == I2C_REP_START))
+				i2c_arm_timeout(i2c_current);   // START went out after all and the ISR is pending - it holds SCL until then
+			else if (++i2c_arbRetries <= I2C_ARB_RETRIES)
+				i2c_arm_timeout(i2c_current);   // START still waiting for another master's STOP
+			else if (i2c_arb_give_up())
+				i2c_claim_bus();
+		}
+	}
+}
+
+/****************************************************************************
+Call this function to find out whether a transaction was aborted with SCL or SDA still
+held low.  Until i2c_recover_bus() frees the bus, i2c_queue_transaction() refuses everything.
+****************************************************************************/
+uint8_t i2c_bus_stuck(void)
+{
+	return(i2c_stuck);
+}
+
+/****************************************************************************
+Call this function to free a bus held by a slave that lost track of where it was.
+The TWI is disabled, SCL is clocked up to nine times until the slave lets go of SDA,
+a STOP is generated by hand and the TWI is re-enabled.  Takes around 100us at most,
+so call it from main line code, not an interrupt.  Returns 1 if both SDA and SCL are
+released afterwards, which lets the queue take transactions again, 0 if the bus is
+still stuck or a transaction is in progress (it's left alone).
+****************************************************************************/
+uint8_t i2c_recover_bus(void)
+{
+	uint8_t i;
+	uint8_t sclPort = I2C_SCL_PORT & _BV(I2C_SCL);
+	uint8_t sdaPort = I2C_SDA_PORT & _BV(I2C_SDA);
+	uint8_t result;
+
+	if (i2c_busy())
+		return(0);
+
+	TWCR = 0;  // Take the pins back from the TWI
+
+	// Open drain: output low to pull a line down, input to release it
+	I2C_SCL_DDR &= ~_BV(I2C_SCL);
+	I2C_SCL_PORT &= ~_BV(I2C_SCL);
+	I2C_SDA_DDR &= ~_BV(I2C_SDA);
+	I2C_SDA_PORT &= ~_BV(I2C_SDA);
+	_delay_us(5);
+
+	for (i=0; (i < 9) && !(I2C_SDA_PIN & _BV(I2C_SDA)); i++)
+	{
+		I2C_SCL_DDR |= _BV(I2C_SCL);
+		_delay_us(5);
+		I2C_SCL_DDR &= ~_BV(I2C_SCL);
+		_delay_us(5);
 	}
 
-	return((i2c_status & (_BV(I2C_MSG_RECV_GOOD))) ? 1:0);
+	// STOP - SDA rising while SCL is high
+	I2C_SCL_DDR |= _BV(I2C_SCL);
+	_delay_us(5);
+	I2C_SDA_DDR |= _BV(I2C_SDA);
+	_delay_us(5);
+	I2C_SCL_DDR &= ~_BV(I2C_SCL);
+	_delay_us(5);
+	I2C_SDA_DDR &= ~_BV(I2C_SDA);
+	_delay_us(5);
+
+	result = ((I2C_SCL_PIN & _BV(I2C_SCL)) && (I2C_SDA_PIN & _BV(I2C_SDA))) ? 1:0;
+
+	// Put the pull-ups back the way they were and hand the pins back to the TWI
+	I2C_SCL_PORT |= sclPort;
+	I2C_SDA_PORT |= sdaPort;
+	TWDR = 0xFF;
+	TWCR = _BV(TWEN);
+
+	if (result)
+		i2c_stuck = 0;
+	return(result);
+}
+
+#ifdef I2C_ENABLE_STATS
+/****************************************************************************
+Call this function to get a consistent copy of the bus telemetry counters.
+****************************************************************************/
+void i2c_stats_snapshot(I2CStats *stats)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		memcpy(stats, &i2c_stats, sizeof(I2CStats));
+	}
 }
 
+void i2c_stats_reset(void)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		memset(&i2c_stats, 0, sizeof(I2CStats));
+	}
+}
+#endif
 
+/****************************************************************************
+Call this function on a multi-master bus to set how this master backs off after losing
+arbitration.  priority 0 is the most urgent; each level adds one backoff window so masters
+with different priorities stop colliding.  seed should differ between masters (e.g. derived
+from a serial number) so masters of equal priority pick different random backoffs.
+****************************************************************************/
+void i2c_arbitration_config(uint8_t priority, uint8_t seed)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		i2c_arbPriority = priority;
+		i2c_random = seed ? seed : 0x5A;
+	}
+}
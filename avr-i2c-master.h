@@ -27,6 +27,8 @@ LICENSE:
 
 // Application Specific Defines - these may need to be adjusted
 
+// Define I2C_DISABLE_BUFFERED_API to drop i2c_transmit()/i2c_receive() and their buffer
+// when all traffic goes through i2c_queue_transaction()/i2c_transfer().
 #ifndef I2C_MAX_BUFFER_SIZE
 #define I2C_MAX_BUFFER_SIZE 16   // Set this to the largest message size that will be sent including address byte.
 #endif
@@ -41,11 +43,193 @@ LICENSE:
 
 #define I2C_TWBR (((F_CPU) / (2UL * (I2C_FREQ))) - 8UL)  // This only works if prescaler = 0
 
+// Bus clock settings, as computed by i2c_calculate_clock().  All zero means "use the bus default";
+// a computed setting has I2C_CLOCK_SET in twps, since TWBR = 0 is a valid (the fastest) setting.
+typedef struct
+{
+	uint8_t twbr;
+	uint8_t twps;   // Prescaler - 0=1x, 1=4x, 2=16x, 3=64x, plus I2C_CLOCK_SET
+} I2CClock;
+
+#define I2C_CLOCK_SET         0x80    // twps flag - this clock was set, rather than left zero for the default
+#define I2C_CLOCK_PRESCALER   0x03    // twps bits that go to TWSR
+
+// i2c_calculate_clock() results
+#define I2C_CLOCK_OK          0
+#define I2C_CLOCK_TOO_FAST    1       // Requested frequency is above what F_CPU can generate
+#define I2C_CLOCK_TOO_SLOW    2       // Requested frequency is below what the largest prescaler can generate
+
+#ifndef I2C_QUEUE_DEPTH
+#define I2C_QUEUE_DEPTH 8   // Maximum number of transactions that can be waiting for the bus
+#endif
+
+#ifndef I2C_URGENT_QUEUE_DEPTH
+#define I2C_URGENT_QUEUE_DEPTH 4   // Maximum number of I2C_XFER_URGENT transactions waiting for the bus
+#endif
+
+// Bulk transfers are split into chunks of this many data bytes.  An urgent transaction waits
+// at most one chunk (plus whatever non-bulk transaction is on the bus) before it gets the bus.
+#ifndef I2C_BULK_CHUNK
+#define I2C_BULK_CHUNK 32
+#endif
+
+#ifndef I2C_TIMEOUT_TICKS
+#define I2C_TIMEOUT_TICKS 10   // i2c_master_tick() calls a transaction may take unless it sets its own timeout
+#endif
+
+#define I2C_TIMEOUT_NONE  0xFF // I2CTransaction timeout - no deadline
+
+// Multi-master arbitration.  A transaction that loses arbitration is retried up to
+// I2C_ARB_RETRIES times before failing with I2C_XFER_ARB_LOST.  Between attempts the master
+// backs off for a random number of i2c_master_tick() calls in a window that starts at
+// I2C_ARB_BACKOFF_TICKS and doubles with each retry, plus a window per priority level
+// (see i2c_arbitration_config()).  Finding the bus busy before a START, or a START waiting
+// a whole timeout for another master, uses up a retry the same way; a transaction that never
+// got on the bus fails with I2C_XFER_ARB_LOST, without any bus recovery.  If the master
+// that won addresses us, it is NACKed (or read 0xFF) and that too counts as lost arbitration.  A streamed
+// transaction (produce or consume set) can't be started over, so it fails with
+// I2C_XFER_ARB_LOST the first time it loses arbitration on the bus.  Backoff and the
+// bus-idle check before a START need i2c_master_tick(); until it is first called, or with
+// I2C_ARB_BACKOFF_TICKS set to 0, the master restarts immediately instead.  The idle check
+// is a single look at SCL and SDA; a busy bus is looked at again on later ticks.
+#ifndef I2C_ARB_RETRIES
+#define I2C_ARB_RETRIES       8
+#endif
+
+#ifndef I2C_ARB_BACKOFF_TICKS
+#define I2C_ARB_BACKOFF_TICKS 1
+#endif
+
+// Pins used to clock a stuck slave off the bus and check it is idle.  The defaults are for the ATmega48/88/168/328.
+#ifndef I2C_SCL
+#define I2C_SCL_PORT  PORTC
+#define I2C_SCL_DDR   DDRC
+#define I2C_SCL_PIN   PINC
+#define I2C_SCL       PC5
+#endif
+
+#ifndef I2C_SDA
+#define I2C_SDA_PORT  PORTC
+#define I2C_SDA_DDR   DDRC
+#define I2C_SDA_PIN   PINC
+#define I2C_SDA       PC4
+#endif
+
 #define I2C_vect            TWI_vect // This should match the ISR vector define of the part you're using
 
+// A queued transaction.  Fields that aren't used should be zero.  The buffer is owned by
+// the caller and must stay valid until the transaction completes - the ISR sends from and
+// receives into it directly, so its size is only limited by length.  Reads must be at
+// least one byte long.
+// If rxLength is non-zero, address must be a write: buffer is sent, then the ISR issues a
+// repeated START and reads rxLength bytes into rxBuffer before the STOP.  This is the usual
+// "set register pointer, then read" sequence as one transaction.
+// For an SMBus block read (I2C_XFER_BLOCK) the count lands in the first byte of the read
+// buffer, followed by the data, and the read length is the buffer's capacity.
+// An I2C_XFER_BULK write checks the urgent lane every
+// I2C_BULK_CHUNK bytes.  If anything is waiting it sends a STOP, lets the urgent traffic
+// through, then continues with a new START, the first prefix bytes of buffer again (a
+// register or control byte, for instance) and the rest of the data.  i2c_queue_transaction()
+// refuses I2C_XFER_BULK combined with I2C_XFER_URGENT, I2C_XFER_PEC, a read phase (rxLength)
+// or a produce callback.
+// With I2C_ENABLE_STREAMING, a transaction can instead take its data from a produce
+// callback and hand what it reads to a consume callback, one byte at a time from the ISR.
+// length/rxLength still set how many bytes move, so up to 64K can go in one START...STOP.
+// The callbacks run with the bus clock stretched, so they must be quick.
+// timeout bounds how long a transaction can hold the bus, however slowly it moves.  A
+// transfer too long to finish in 254 ticks (a long stream, say) sets it to I2C_TIMEOUT_NONE
+// and bounds each byte with idleTimeout instead.  A resumed bulk transfer starts its
+// timeout over, so it bounds each stretch on the bus.
+typedef struct I2CTransaction
+{
+	uint8_t address;                          // Slave address (shifted left) with the R/W bit
+	uint8_t *buffer;                          // Data to send, or space for data to read
+	uint16_t length;                          // Number of data bytes, not including the address
+	uint8_t *rxBuffer;                        // Space for data read after a repeated START
+	uint16_t rxLength;                        // Bytes to read after the write, 0 for none
+	I2CClock clock;                           // Bus clock for this transaction, zero for the default
+	uint8_t timeout;                          // i2c_master_tick() calls the whole transaction may take, 0 for I2C_TIMEOUT_TICKS, or I2C_TIMEOUT_NONE
+	uint8_t idleTimeout;                      // i2c_master_tick() calls allowed between bytes, 0 for no limit
+	uint8_t flags;                            // I2C_XFER_SEND_STOP, etc.
+	uint8_t prefix;                           // I2C_XFER_BULK - leading bytes of buffer to resend after each preemption
+	volatile uint8_t status;                  // I2C_XFER_QUEUED/ACTIVE/DONE or an error, updated by the ISR
+	void (*callback)(struct I2CTransaction*); // Called from the ISR on completion, may be NULL
+#ifdef I2C_ENABLE_STREAMING
+	uint8_t (*produce)(struct I2CTransaction*);         // If set, called for each byte to send instead of reading buffer
+	void (*consume)(struct I2CTransaction*, uint8_t);   // If set, called with each byte read instead of filling the read buffer
+#endif
+} I2CTransaction;
+
+// I2CTransaction flags
+#define I2C_XFER_SEND_STOP    0x01    // Send a STOP after this transaction, otherwise the next one uses a repeated START
+#define I2C_XFER_PEC          0x02    // SMBus PEC - append to writes, check on reads (needs I2C_ENABLE_PEC)
+#define I2C_XFER_BLOCK        0x04    // SMBus block read - the first byte read is the count, which ends the read
+#define I2C_XFER_PROGMEM      0x08    // buffer is in program memory (write data only, first 64K of flash)
+#define I2C_XFER_URGENT       0x10    // Goes in the high priority lane, ahead of all normal traffic
+#define I2C_XFER_BULK         0x20    // Long write that urgent traffic may interrupt every I2C_BULK_CHUNK bytes
+
+// I2CTransaction status
+#define I2C_XFER_IDLE         0x00
+#define I2C_XFER_QUEUED       0x01    // Waiting in the queue
+#define I2C_XFER_ACTIVE       0x02    // On the bus
+#define I2C_XFER_DONE         0x03    // Completed successfully, read data is in buffer
+#define I2C_XFER_FAILED       0x04    // Completed with an unexpected TWI state, i2c_state holds the code
+#define I2C_XFER_ADDR_NACK    0x05    // Slave didn't acknowledge its address
+#define I2C_XFER_DATA_NACK    0x06    // Slave didn't acknowledge a data byte
+#define I2C_XFER_BUS_ERROR    0x07    // Illegal START or STOP seen, the TWI was reset
+#define I2C_XFER_TIMEOUT      0x08    // Didn't complete in time, the TWI was reset
+#define I2C_XFER_BUS_STUCK    0x09    // SDA/SCL still held low after an abort, needs i2c_recover_bus()
+#define I2C_XFER_ARB_LOST     0x0A    // Lost arbitration to another master I2C_ARB_RETRIES times (once if streamed)
+#define I2C_XFER_PEC_ERROR    0x0B    // PEC read from the slave didn't match the data
+#define I2C_XFER_BLOCK_SIZE   0x0C    // Block read count was larger than the buffer
+
+#define I2C_XFER_RESULTS      0x0D    // One more than the last status code
+
+#define I2C_XFER_COMPLETE(status)  ((status) >= I2C_XFER_DONE)
+
+#ifdef I2C_ENABLE_STATS
+// Bus telemetry, compiled in with I2C_ENABLE_STATS.  Times are in counts of I2C_STATS_TIMER,
+// which must be a free-running 16 bit timer set up by the application - at prescaler 1 they
+// are CPU cycles.  A single transaction longer than one timer period will be undercounted.
+#ifndef I2C_STATS_TIMER
+#define I2C_STATS_TIMER    TCNT1
+#endif
+
+#ifndef I2C_STATS_DEVICES
+#define I2C_STATS_DEVICES  8   // Number of slave addresses tracked individually
+#endif
+
+typedef struct
+{
+	uint8_t address;           // 7 bit slave address, 0 if the slot is unused
+	uint16_t success;
+	uint16_t failure;
+} I2CDeviceStats;
+
+typedef struct
+{
+	uint16_t states[32];                 // ISR entries by TWI state, indexed by state >> 3
+	uint16_t results[I2C_XFER_RESULTS];  // Completed transactions by I2C_XFER_* status
+	uint32_t bytesSent;                  // Data bytes, not including addresses
+	uint32_t bytesReceived;
+	uint32_t busyTime;                   // Timer counts from each transaction's START to its completion
+	uint32_t isrTime;                    // Timer counts spent in the ISR
+	uint16_t isrMax;                     // Longest single pass through the ISR
+	uint16_t urgentWaitMax;              // Longest an urgent transaction waited between being queued and its START
+	I2CDeviceStats devices[I2C_STATS_DEVICES];
+} I2CStats;
+
+#define I2C_STATS_STATE(stats, state)  ((stats)->states[(state) >> 3])
+
+void i2c_stats_snapshot(I2CStats *stats);
+void i2c_stats_reset(void);
+#endif
+
+#ifndef I2C_DISABLE_BUFFERED_API
 extern volatile uint8_t i2c_buffer[ I2C_MAX_BUFFER_SIZE ];    // Transceiver buffer
-extern uint8_t i2c_bufferLen;                   // Number of bytes to be transmitted.
-extern volatile uint8_t i2c_bufferIdx;
+#endif
+extern uint16_t i2c_bufferLen;                  // Number of data bytes in the current transaction
+extern volatile uint16_t i2c_bufferIdx;
 extern volatile uint8_t i2c_state;      // State byte. Default set to I2C_NO_STATE.
 
 
@@ -53,12 +237,28 @@ extern volatile uint8_t i2c_state;      // State byte. Default set to I2C_NO_STA
 
 void i2c_master_init(void);
 uint8_t i2c_busy(void);
+#ifndef I2C_DISABLE_BUFFERED_API
 void i2c_transmit(uint8_t *msgBuffer, uint8_t msgLen, uint8_t sendStop);
 uint8_t i2c_receive(uint8_t *msgBuffer, uint8_t msgLen);
 uint8_t i2c_transaction_successful();
+#endif
+uint8_t i2c_queue_transaction(I2CTransaction *t);
+uint8_t i2c_queue_depth(void);
+uint8_t i2c_transfer(I2CTransaction *t);
+uint8_t i2c_read_register(uint8_t address, uint8_t reg, uint8_t *data, uint8_t len);
+uint8_t i2c_calculate_clock(uint32_t freq, I2CClock *clock);
+uint8_t i2c_set_clock(uint32_t freq);
+uint32_t i2c_clock_frequency(const I2CClock *clock);
+void i2c_master_tick(void);
+uint8_t i2c_bus_stuck(void);
+uint8_t i2c_recover_bus(void);
+void i2c_arbitration_config(uint8_t priority, uint8_t seed);
 
 #define I2C_MSG_RECV_GOOD     0       // i2c_status, bit 0 shows last message is good
 #define I2C_MSG_SEND_STOP     1       // i2c_status, omit stop at the end of transmit
+#define I2C_MSG_READ_PHASE    2       // i2c_status, reading after the repeated START of a write-then-read
+#define I2C_MSG_PEC_BAD       3       // i2c_status, received PEC didn't match
+#define I2C_MSG_BLOCK_OVERFLOW 4      // i2c_status, block read count didn't fit in the buffer
 #define I2C_READ_BIT          0       // Bit 0 is Read / !Write in address
 
 /****************************************************************************
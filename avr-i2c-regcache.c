@@ -0,0 +1,155 @@
+/*************************************************************************
+Title:    MRBus AVR I2C Library - Register Shadow Cache
+Authors:  Nathan D. Holmes <maverick@drgw.net>
+File:     avr-i2c-regcache.c
+License:  GNU General Public License v3
+
+LICENSE:
+    Copyright (C) 2012 Nathan Holmes
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+*************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include "avr-i2c-regcache.h"
+
+#define BIT_IS_SET(map, bit)   ((map)[(bit) >> 3] & _BV((bit) & 0x07))
+#define BIT_SET(map, bit)      ((map)[(bit) >> 3] |= _BV((bit) & 0x07))
+#define BIT_CLEAR(map, bit)    ((map)[(bit) >> 3] &= ~_BV((bit) & 0x07))
+
+static uint8_t i2c_regcache_is_volatile(I2CRegCache *cache, uint8_t reg)
+{
+	return((NULL != cache->volatileRegs) && BIT_IS_SET(cache->volatileRegs, reg));
+}
+
+void i2c_regcache_init(I2CRegCache *cache)
+{
+	memset(cache->valid, 0, I2C_REGCACHE_BITMAP_SIZE(cache->size));
+	memset(cache->dirty, 0, I2C_REGCACHE_BITMAP_SIZE(cache->size));
+}
+
+/****************************************************************************
+Call this function to read a register.  Non-volatile registers already in the cache are
+served from RAM, anything else is read from the device (and cached if it can be).  A dirty
+register always comes from RAM, so a pending write isn't lost to a volatile refresh.
+Returns 1 on success, 0 if the register is out of range or the bus read failed.
+****************************************************************************/
+uint8_t i2c_regcache_read(I2CRegCache *cache, uint8_t reg, uint8_t *value)
+{
+	if (reg >= cache->size)
+		return(0);
+
+	if ((!BIT_IS_SET(cache->valid, reg) || i2c_regcache_is_volatile(cache, reg)) && !BIT_IS_SET(cache->dirty, reg))
+	{
+		if (!i2c_read_register(cache->address, reg, &cache->shadow[reg], 1))
+			return(0);
+		if (!i2c_regcache_is_volatile(cache, reg))
+			BIT_SET(cache->valid, reg);
+	}
+
+	*value = cache->shadow[reg];
+	return(1);
+}
+
+/****************************************************************************
+Call this function to write a register.  Only the shadow is changed; the device is updated
+by the next i2c_regcache_flush().  Writing the value a valid register already holds is free.
+****************************************************************************/
+void i2c_regcache_write(I2CRegCache *cache, uint8_t reg, uint8_t value)
+{
+	if (reg >= cache->size)
+		return;
+
+	if (BIT_IS_SET(cache->valid, reg) && (cache->shadow[reg] == value) && !i2c_regcache_is_volatile(cache, reg))
+		return;
+
+	cache->shadow[reg] = value;
+	BIT_SET(cache->valid, reg);
+	BIT_SET(cache->dirty, reg);
+}
+
+/****************************************************************************
+Call this function to change the bits in mask to value, read-modify-write style.
+The read comes from the cache when it can.  Returns 1 on success, 0 if the read failed.
+****************************************************************************/
+uint8_t i2c_regcache_update(I2CRegCache *cache, uint8_t reg, uint8_t mask, uint8_t value)
+{
+	uint8_t current;
+
+	if (!i2c_regcache_read(cache, reg, &current))
+		return(0);
+
+	i2c_regcache_write(cache, reg, (current & ~mask) | (value & mask));
+	return(1);
+}
+
+/****************************************************************************
+Call this function to write all dirty registers to the device.  Runs of adjacent dirty
+registers go out as one auto-increment burst; runs separated by no more than
+I2C_REGCACHE_MAX_GAP clean registers are joined, since resending a byte is cheaper
+than another START and address.  Returns 1 on success, 0 if a write failed (the
+registers that didn't make it stay dirty).
+****************************************************************************/
+uint8_t i2c_regcache_flush(I2CRegCache *cache)
+{
+	uint8_t buffer[I2C_REGCACHE_MAX_BURST + 1];
+	I2CTransaction t;
+	uint16_t reg = 0;
+	uint8_t result = 1;
+
+	memset(&t, 0, sizeof(t));
+	t.address = cache->address << 1;
+	t.buffer = buffer;
+	t.flags = I2C_XFER_SEND_STOP;
+
+	while (reg < cache->size)
+	{
+		uint16_t start, end, next;
+
+		if (!BIT_IS_SET(cache->dirty, reg))
+		{
+			reg++;
+			continue;
+		}
+
+		// Find the end of this run, bridging short gaps of clean (but known) registers
+		start = reg;
+		end = reg + 1;
+		next = end;
+		while ((next < cache->size) && ((next - start) < I2C_REGCACHE_MAX_BURST))
+		{
+			if (BIT_IS_SET(cache->dirty, next))
+				end = ++next;
+			else if ((next - end) < I2C_REGCACHE_MAX_GAP && BIT_IS_SET(cache->valid, next) && !i2c_regcache_is_volatile(cache, next))
+				next++;
+			else
+				break;
+		}
+
+		buffer[0] = start | cache->autoIncrement;
+		memcpy(buffer + 1, cache->shadow + start, end - start);
+		t.length = end - start + 1;
+
+		if (i2c_transfer(&t))
+		{
+			for (reg = start; reg < end; reg++)
+				BIT_CLEAR(cache->dirty, reg);
+		} else {
+			result = 0;
+		}
+		reg = end;
+	}
+
+	return(result);
+}
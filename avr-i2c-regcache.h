@@ -0,0 +1,56 @@
+/*************************************************************************
+Title:    MRBus AVR I2C Library - Register Shadow Cache
+Authors:  Nathan D. Holmes <maverick@drgw.net>
+File:     avr-i2c-regcache.h
+License:  GNU General Public License v3
+
+LICENSE:
+    Copyright (C) 2012 Nathan Holmes
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+*************************************************************************/
+
+#ifndef _AVR_I2C_REGCACHE_H
+#define _AVR_I2C_REGCACHE_H
+
+#include "avr-i2c-master.h"
+
+#ifndef I2C_REGCACHE_MAX_BURST
+#define I2C_REGCACHE_MAX_BURST 32   // Largest number of registers written by one flush transaction
+#endif
+
+#ifndef I2C_REGCACHE_MAX_GAP
+#define I2C_REGCACHE_MAX_GAP   2    // Clean registers a flush will rewrite to join two dirty runs
+#endif
+
+#define I2C_REGCACHE_BITMAP_SIZE(regs)  (((regs) + 7) / 8)
+
+// Shadow copy of registers 0 to size-1 of one device.  The application provides the
+// storage: shadow is size bytes, the bitmaps are I2C_REGCACHE_BITMAP_SIZE(size) bytes.
+typedef struct
+{
+	uint8_t address;              // 7 bit slave address
+	uint8_t size;                 // Number of registers cached
+	uint8_t autoIncrement;        // OR'd into the register pointer of burst writes (e.g. 0x80), 0 if not needed
+	uint8_t *shadow;
+	uint8_t *valid;               // Bitmap - shadow holds the device's value
+	uint8_t *dirty;               // Bitmap - shadow has been written but not flushed
+	const uint8_t *volatileRegs;  // Bitmap - registers the device changes itself, never served from the cache.  May be NULL.
+} I2CRegCache;
+
+void i2c_regcache_init(I2CRegCache *cache);
+uint8_t i2c_regcache_read(I2CRegCache *cache, uint8_t reg, uint8_t *value);
+void i2c_regcache_write(I2CRegCache *cache, uint8_t reg, uint8_t value);
+uint8_t i2c_regcache_update(I2CRegCache *cache, uint8_t reg, uint8_t mask, uint8_t value);
+uint8_t i2c_regcache_flush(I2CRegCache *cache);
+
+#endif
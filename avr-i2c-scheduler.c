@@ -0,0 +1,171 @@
+/*************************************************************************
+Title:    MRBus AVR I2C Library - Periodic Read Scheduler
+Authors:  Nathan D. Holmes <maverick@drgw.net>
+File:     avr-i2c-scheduler.c
+License:  GNU General Public License v3
+
+LICENSE:
+    Copyright (C) 2012 Nathan Holmes
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+*************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+#include "avr-i2c-scheduler.h"
+
+static I2CScheduleEntry *i2c_schedule = NULL;
+static uint8_t i2c_scheduleCount = 0;
+
+// Runs from the I2C ISR when a scheduled read finishes.  Only a good read makes the
+// sequence even again - after a failure dest may hold part of a sample, so it stays odd
+// until the next read succeeds.
+static void i2c_scheduler_done(I2CTransaction *t)
+{
+	uint8_t i;
+
+	for (i=0; i<i2c_scheduleCount; i++)
+	{
+		if (&i2c_schedule[i].xfer == t)
+		{
+			i2c_schedule[i].status = t->status;
+			if (I2C_XFER_DONE == t->status)
+				i2c_schedule[i].sequence++;
+			else
+				i2c_schedule[i].failures++;
+			break;
+		}
+	}
+}
+
+/****************************************************************************
+Call this function to start reading each entry's registers every period ticks.  Entries
+are staggered by their position in the table so they don't all come due on the same tick.
+Returns 1 if the schedule fits in the bus bandwidth, 0 if it doesn't (it is installed anyway).
+****************************************************************************/
+uint8_t i2c_scheduler_init(I2CScheduleEntry *entries, uint8_t count)
+{
+	uint8_t i;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		for (i=0; i<count; i++)
+		{
+			I2CScheduleEntry *e = &entries[i];
+			I2CClock clock = e->xfer.clock;
+			e->sequence = 1;    // Odd - dest holds nothing until the first read completes
+			e->status = I2C_XFER_IDLE;
+			e->overruns = 0;
+			e->failures = 0;
+			e->countdown = (i % e->period) + 1;
+			memset(&e->xfer, 0, sizeof(e->xfer));
+			e->xfer.clock = clock;
+			e->xfer.address = e->address << 1;
+			e->xfer.buffer = &e->reg;
+			e->xfer.length = 1;
+			e->xfer.rxBuffer = e->dest;
+			e->xfer.rxLength = e->length;
+			e->xfer.flags = I2C_XFER_SEND_STOP;
+			e->xfer.callback = i2c_scheduler_done;
+		}
+		i2c_schedule = entries;
+		i2c_scheduleCount = count;
+	}
+
+	return((i2c_scheduler_load() <= 100) ? 1:0);
+}
+
+/****************************************************************************
+Call this function from a timer interrupt at I2C_SCHEDULER_TICK_HZ.  Every entry that
+comes due is queued on the master; the ISR then runs them back to back.
+****************************************************************************/
+void i2c_scheduler_tick(void)
+{
+	uint8_t i;
+
+	for (i=0; i<i2c_scheduleCount; i++)
+	{
+		I2CScheduleEntry *e = &i2c_schedule[i];
+
+		if (--e->countdown)
+			continue;
+		e->countdown = e->period;
+
+		if ((I2C_XFER_QUEUED == e->xfer.status) || (I2C_XFER_ACTIVE == e->xfer.status))
+		{
+			e->overruns++;
+			continue;
+		}
+
+		// Already odd if the last read failed - dest wasn't good to begin with
+		if (I2C_SCHEDULER_VALID(e->sequence))
+		{
+			e->sequence++;
+			if (!i2c_queue_transaction(&e->xfer))
+			{
+				e->sequence++;
+				e->overruns++;
+			}
+		} else if (!i2c_queue_transaction(&e->xfer)) {
+			e->overruns++;
+		}
+	}
+}
+
+/****************************************************************************
+Call this function to estimate the share of the bus the schedule uses, in percent.
+Each read is counted as START, SLA+W, register, repeated START, SLA+R, data bytes and
+STOP at 9 bit times per byte and 1 per START/STOP, at the bus clock of its own transaction.
+****************************************************************************/
+uint16_t i2c_scheduler_load(void)
+{
+	uint32_t load = 0;   // Percent of the bus, times 100
+	uint8_t i;
+
+	for (i=0; i<i2c_scheduleCount; i++)
+	{
+		uint32_t bits = 9UL * (3 + i2c_schedule[i].length) + 3;
+		uint32_t bitsPerSecond = (bits * I2C_SCHEDULER_TICK_HZ) / i2c_schedule[i].period;
+		load += (bitsPerSecond * 100) / (i2c_clock_frequency(&i2c_schedule[i].xfer.clock) / 100);
+	}
+
+	load /= 100;
+	return((load > 0xFFFF) ? 0xFFFF : load);
+}
+
+/****************************************************************************
+Call this function to copy the latest complete sample of an entry into data without
+tearing.  Returns the (even) sequence number of the sample copied.  If no read has
+completed yet, a read is on the bus, the last one failed or the copy was torn
+I2C_SCHEDULER_READ_TRIES times running, it gives up and returns an odd number - data
+is then not valid, try again later.
+****************************************************************************/
+uint8_t i2c_scheduler_read(I2CScheduleEntry *entry, uint8_t *data)
+{
+	uint8_t seq = 0x01;
+	uint8_t tries;
+
+	for (tries=0; tries<I2C_SCHEDULER_READ_TRIES; tries++)
+	{
+		seq = entry->sequence;
+		if (!I2C_SCHEDULER_VALID(seq))
+			break;
+		memcpy(data, entry->dest, entry->length);
+		if (seq == entry->sequence)
+			return(seq);
+		seq |= 0x01;
+	}
+
+	return(seq);
+}
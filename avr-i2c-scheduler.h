@@ -0,0 +1,62 @@
+/*************************************************************************
+Title:    MRBus AVR I2C Library - Periodic Read Scheduler
+Authors:  Nathan D. Holmes <maverick@drgw.net>
+File:     avr-i2c-scheduler.h
+License:  GNU General Public License v3
+
+LICENSE:
+    Copyright (C) 2012 Nathan Holmes
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+*************************************************************************/
+
+#ifndef _AVR_I2C_SCHEDULER_H
+#define _AVR_I2C_SCHEDULER_H
+
+#include "avr-i2c-master.h"
+
+#ifndef I2C_SCHEDULER_TICK_HZ
+#define I2C_SCHEDULER_TICK_HZ 1000   // Rate i2c_scheduler_tick() is called at, used for the bandwidth check
+#endif
+
+#ifndef I2C_SCHEDULER_READ_TRIES
+#define I2C_SCHEDULER_READ_TRIES 3   // Copies i2c_scheduler_read() attempts before reporting the entry busy
+#endif
+
+// One periodic register read.  The application fills in the first five fields, and
+// xfer.clock if the slave needs something other than the default bus clock.  The rest
+// belong to the scheduler.
+typedef struct
+{
+	uint8_t address;             // 7 bit slave address
+	uint8_t reg;                 // First register to read
+	uint8_t length;              // Number of bytes to read
+	uint16_t period;             // Ticks between reads, at least 1
+	uint8_t *dest;               // Where the data goes
+
+	volatile uint8_t sequence;   // Even while dest holds a good sample, odd until the first read and while updating or after a failure
+	volatile uint8_t status;     // Result of the last read - I2C_XFER_DONE or the error it failed with
+	uint8_t overruns;            // Reads skipped because the previous one hadn't finished
+	uint8_t failures;            // Reads that failed on the bus
+	uint16_t countdown;
+	I2CTransaction xfer;
+} I2CScheduleEntry;
+
+// i2c_scheduler_read() returns an odd sequence number when it couldn't copy a good sample
+#define I2C_SCHEDULER_VALID(sequence)  (!((sequence) & 0x01))
+
+uint8_t i2c_scheduler_init(I2CScheduleEntry *entries, uint8_t count);
+void i2c_scheduler_tick(void);
+uint16_t i2c_scheduler_load(void);
+uint8_t i2c_scheduler_read(I2CScheduleEntry *entry, uint8_t *data);
+
+#endif
@@ -0,0 +1,137 @@
+/*************************************************************************
+Title:    MRBus AVR I2C Library - Flash Command Sequence Player
+Authors:  Nathan D. Holmes <maverick@drgw.net>
+File:     avr-i2c-sequence.c
+License:  GNU General Public License v3
+
+LICENSE:
+    Copyright (C) 2012 Nathan Holmes
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+*************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include "avr-i2c-sequence.h"
+
+static const uint8_t *seq_ptr;          // Next record, in flash
+static volatile uint8_t seq_delay = 0;
+static volatile uint8_t seq_status = I2C_XFER_IDLE;
+static I2CTransaction seq_xfer;
+
+// Work through records until a write has been queued, a delay starts or the sequence ends.
+// Runs from the I2C ISR as each write completes, so the writes go out back to back.
+static void i2c_sequence_next(void)
+{
+	uint8_t flags = I2C_XFER_PROGMEM | I2C_XFER_SEND_STOP;
+	uint8_t code;
+
+	while (1)
+	{
+		code = pgm_read_byte(seq_ptr++);
+		switch (code)
+		{
+			case I2C_SEQ_END:
+				seq_status = I2C_XFER_DONE;
+				return;
+
+			case I2C_SEQ_DELAY_CODE:
+				seq_delay = pgm_read_byte(seq_ptr++);
+				if (0 == seq_delay)
+					break;
+				return;
+
+			case I2C_SEQ_RESTART:
+				flags &= ~I2C_XFER_SEND_STOP;
+				break;
+
+			default:
+				seq_xfer.length = code;
+				seq_xfer.address = pgm_read_byte(seq_ptr++);
+				seq_xfer.buffer = (uint8_t*)seq_ptr;
+				seq_xfer.flags = flags;
+				seq_ptr += code;
+				// Nothing would pick the sequence up again, so a full queue ends it
+				if (!i2c_queue_transaction(&seq_xfer))
+					seq_status = I2C_XFER_FAILED;
+				return;
+		}
+	}
+}
+
+static void i2c_sequence_done(I2CTransaction *t)
+{
+	if (I2C_XFER_DONE != t->status)
+	{
+		seq_status = t->status;
+		return;
+	}
+	i2c_sequence_next();
+}
+
+/****************************************************************************
+Call this function to start playing a PROGMEM sequence without waiting.  Writes are sent
+straight from flash by the ISR, nothing is copied to RAM.
+Returns 1 if the sequence was started, 0 if one is already playing.
+****************************************************************************/
+uint8_t i2c_sequence_start(const uint8_t *sequence)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (I2C_XFER_ACTIVE == seq_status)
+			return(0);
+
+		memset(&seq_xfer, 0, sizeof(seq_xfer));
+		seq_xfer.callback = i2c_sequence_done;
+		seq_ptr = sequence;
+		seq_delay = 0;
+		seq_status = I2C_XFER_ACTIVE;
+		i2c_sequence_next();
+	}
+	return(1);
+}
+
+/****************************************************************************
+Call this function to check on a sequence.  Returns I2C_XFER_ACTIVE while it is playing,
+then I2C_XFER_DONE or the error that stopped it (I2C_XFER_FAILED if the master's queue
+was full when a write was due).
+****************************************************************************/
+uint8_t i2c_sequence_status(void)
+{
+	return(seq_status);
+}
+
+/****************************************************************************
+Call this function from a timer interrupt to time I2C_SEQ_DELAY records.
+****************************************************************************/
+void i2c_sequence_tick(void)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if ((0 != seq_delay) && (0 == --seq_delay) && (I2C_XFER_ACTIVE == seq_status))
+			i2c_sequence_next();
+	}
+}
+
+/****************************************************************************
+Call this function to play a sequence and wait for it to finish.
+Returns I2C_XFER_DONE or the error that stopped it.
+****************************************************************************/
+uint8_t i2c_sequence_play(const uint8_t *sequence)
+{
+	while (!i2c_sequence_start(sequence));
+	while (I2C_XFER_ACTIVE == seq_status);
+	return(seq_status);
+}
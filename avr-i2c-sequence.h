@@ -0,0 +1,56 @@
+/*************************************************************************
+Title:    MRBus AVR I2C Library - Flash Command Sequence Player
+Authors:  Nathan D. Holmes <maverick@drgw.net>
+File:     avr-i2c-sequence.h
+License:  GNU General Public License v3
+
+LICENSE:
+    Copyright (C) 2012 Nathan Holmes
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+*************************************************************************/
+
+#ifndef _AVR_I2C_SEQUENCE_H
+#define _AVR_I2C_SEQUENCE_H
+
+#include <avr/pgmspace.h>
+#include "avr-i2c-master.h"
+
+// A sequence is a PROGMEM byte array of records, played in order straight from flash:
+//
+//   I2C_SEQ_WRITE(address, n), followed by n data bytes (n up to I2C_SEQ_MAX_WRITE)
+//   I2C_SEQ_RESTART           - the next write ends without a STOP, so the one after it
+//                               follows with a repeated START
+//   I2C_SEQ_DELAY(ticks)      - wait that many i2c_sequence_tick() calls (1-255)
+//   I2C_SEQ_END               - must be last
+//
+// For example:
+//   const uint8_t displayInit[] PROGMEM = {
+//       I2C_SEQ_WRITE(0x3C, 3), 0x00, 0xAE, 0xD5,
+//       I2C_SEQ_DELAY(10),
+//       I2C_SEQ_WRITE(0x3C, 2), 0x00, 0xAF,
+//       I2C_SEQ_END
+//   };
+
+#define I2C_SEQ_MAX_WRITE    0xFC
+#define I2C_SEQ_RESTART      0xFD
+#define I2C_SEQ_DELAY_CODE   0xFE
+#define I2C_SEQ_DELAY(ticks) I2C_SEQ_DELAY_CODE, (ticks)
+#define I2C_SEQ_END          0xFF
+#define I2C_SEQ_WRITE(address, n)  (n), ((address) << 1)
+
+uint8_t i2c_sequence_start(const uint8_t *sequence);
+uint8_t i2c_sequence_status(void);
+void i2c_sequence_tick(void);
+uint8_t i2c_sequence_play(const uint8_t *sequence);
+
+#endif
@@ -2,12 +2,147 @@
 #include <string.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
+#ifdef I2C_ENABLE_REGIONS
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#endif
 #include "avr-i2c-slave.h"
  
  
+#ifdef I2C_MULTI_ADDRESS
+// The map of whichever device was addressed last, switched on address match
+static volatile uint8_t *i2c_registerMap = NULL;
+static volatile uint8_t *i2c_registerAttributes = NULL;
+static I2CRegIndex i2c_registerMapSize = 0;
+
+// Stands in for an address TWAMR let through that isn't one of ours, and for every
+// address until i2c_slave_init_multi() installs the list
+static I2CSlaveDevice i2c_noDevice;
+
+static I2CSlaveDevice *i2c_devices = NULL;
+static uint8_t i2c_deviceCount = 0;
+static I2CSlaveDevice *i2c_device = &i2c_noDevice;
+#else
 extern volatile uint8_t i2c_registerMap[];
+#ifndef I2C_NO_READONLY
 extern volatile uint8_t i2c_registerAttributes[];
-extern uint8_t i2c_registerMapSize;
+#endif
+#ifdef I2C_MAP_SIZE
+#define i2c_registerMapSize  (I2C_MAP_SIZE)
+#else
+extern I2CRegIndex i2c_registerMapSize;
+#endif
+#endif
+
+// With a fixed power of two map the pointer just wraps; otherwise it's bounds checked and saturates
+#ifdef I2C_MAP_SIZE
+#define I2C_REG_WRAP(reg)    ((reg) & (I2C_MAP_SIZE - 1))
+#define I2C_REG_IN_MAP(reg)  (1)
+#else
+#define I2C_REG_WRAP(reg)    (reg)
+#define I2C_REG_IN_MAP(reg)  ((reg) < i2c_registerMapSize)
+#endif
+
+// Read-only lookups for a run of consecutive registers: I2C_ATTR_SEEK(reg) before the
+// first, I2C_ATTR_READONLY(reg) for each, then I2C_ATTR_NEXT(reg) to step past it.
+// Packed attributes keep the current bitmap byte and a mask that shifts one register
+// at a time, loading the next byte only every eighth register, so a byte written costs
+// about what the one byte per register load does.
+#if defined(I2C_NO_READONLY)
+#define I2C_ATTR_SEEK(reg)      ((void)0)
+#define I2C_ATTR_READONLY(reg)  (0)
+#define I2C_ATTR_NEXT(reg)      ((void)0)
+#elif defined(I2C_PACKED_ATTRIBUTES)
+static const uint8_t i2c_bitMask[8] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80 };
+static uint8_t i2c_attrBits = 0;
+static uint8_t i2c_attrMask = 0;
+
+#define I2C_ATTR_SEEK(reg) \
+	do { \
+		i2c_attrMask = i2c_bitMask[(reg) & 0x07]; \
+		if (I2C_REG_IN_MAP(reg)) \
+			i2c_attrBits = i2c_registerAttributes[(reg)>>3]; \
+	} while(0)
+#define I2C_ATTR_READONLY(reg)  (i2c_attrBits & i2c_attrMask)
+#define I2C_ATTR_NEXT(reg) \
+	do { \
+		if (0 == (I2C_REG_WRAP((reg) + 1) & 0x07)) \
+		{ \
+			i2c_attrMask = 0x01; \
+			if (I2C_REG_IN_MAP(I2C_REG_WRAP((reg) + 1))) \
+				i2c_attrBits = i2c_registerAttributes[I2C_REG_WRAP((reg) + 1)>>3]; \
+		} else \
+			i2c_attrMask <<= 1; \
+	} while(0)
+#else
+#define I2C_ATTR_SEEK(reg)      ((void)0)
+#define I2C_ATTR_READONLY(reg)  (i2c_registerAttributes[(reg)] & I2CREG_ATTR_READONLY)
+#define I2C_ATTR_NEXT(reg)      ((void)0)
+#endif
+
+#ifdef I2C_ENABLE_REGIONS
+extern const I2CRegisterRegion i2c_registerRegions[];
+extern uint8_t i2c_registerRegionCount;
+
+#ifdef I2C_16BIT_REGISTERS
+#define I2C_PGM_READ_REG(addr)  pgm_read_word(addr)
+#else
+#define I2C_PGM_READ_REG(addr)  pgm_read_byte(addr)
+#endif
+
+// The run of registers the current read is in, all served from the same place
+static I2CRegIndex i2c_spanFirst = 0;
+static I2CRegIndex i2c_spanLast = 0;
+static uint8_t i2c_spanSource = I2CREG_SOURCE_NONE;
+static const uint8_t *i2c_spanData = NULL;
+
+// Find where reg lives and how far the run extends before the backing store changes.
+// Only called at SLA+R and when a read crosses the end of a run, never per byte.
+static void i2c_find_span(I2CRegIndex reg)
+{
+	uint8_t i;
+	I2CRegIndex first, last;
+	I2CRegIndex next = I2C_REG_MAX;
+
+#ifdef I2C_MULTI_ADDRESS
+	// Regions belong to the listed devices - an address that isn't one of them reads as 0xFF
+	if (&i2c_noDevice == i2c_device)
+	{
+		i2c_spanFirst = reg;
+		i2c_spanLast = I2C_REG_MAX;
+		i2c_spanSource = I2CREG_SOURCE_NONE;
+		return;
+	}
+#endif
+
+	for(i=0; i<i2c_registerRegionCount; i++)
+	{
+		first = I2C_PGM_READ_REG(&i2c_registerRegions[i].first);
+		last = I2C_PGM_READ_REG(&i2c_registerRegions[i].last);
+		if (reg >= first && reg <= last)
+		{
+			i2c_spanFirst = first;
+			i2c_spanLast = last;
+			i2c_spanSource = pgm_read_byte(&i2c_registerRegions[i].source);
+			i2c_spanData = pgm_read_ptr(&i2c_registerRegions[i].data);
+			return;
+		}
+		if (first > reg && (first - 1) < next)
+			next = first - 1;
+	}
+
+	i2c_spanFirst = reg;
+	i2c_spanSource = I2CREG_SOURCE_NONE;
+	if (reg < i2c_registerMapSize)
+	{
+		i2c_spanSource = I2CREG_SOURCE_RAM;
+		if ((i2c_registerMapSize - 1) < next)
+			next = i2c_registerMapSize - 1;
+	}
+	i2c_spanLast = next;
+}
+#endif
  
 volatile I2CState i2c_state = I2C_NO_STATE;  // State byte. Default set to I2C_NO_STATE.
 
@@ -16,15 +151,345 @@ volatile I2CState i2c_state = I2C_NO_STATE;  // State byte. Default set to I2C_N
 // Also used to determine how deep we can sleep.
 volatile uint8_t i2c_busy = 0;
 
+#ifdef I2C_ENABLE_FIFO
+static I2CFifoPort *i2c_fifoPorts = NULL;
+static uint8_t i2c_fifoPortCount = 0;
+
+// FIFOs the current read and write are streaming through, if any
+static I2CFifo *i2c_txFifo = NULL;
+static I2CFifo *i2c_rxFifo = NULL;
+
+// Unlocked versions for the ISR
+static uint8_t i2c_fifo_put(I2CFifo *fifo, uint8_t data)
+{
+	if (fifo->full)
+		return(0);
+
+	fifo->buffer[fifo->head] = data;
+	if (++fifo->head >= fifo->size)
+		fifo->head = 0;
+	if (fifo->head == fifo->tail)
+		fifo->full = 1;
+	return(1);
+}
+
+static uint8_t i2c_fifo_get(I2CFifo *fifo, uint8_t *data)
+{
+	if (!fifo->full && fifo->head == fifo->tail)
+		return(0);
+
+	*data = fifo->buffer[fifo->tail];
+	if (++fifo->tail >= fifo->size)
+		fifo->tail = 0;
+	fifo->full = 0;
+	return(1);
+}
+
+// Returns the port at reg, or NULL if reg is an ordinary register
+static I2CFifoPort* i2c_find_fifo(I2CRegIndex reg)
+{
+	uint8_t i;
+	for(i=0; i<i2c_fifoPortCount; i++)
+	{
+		if (i2c_fifoPorts[i].reg == reg)
+			return(&i2c_fifoPorts[i]);
+	}
+	return(NULL);
+}
+
+/****************************************************************************
+Call this function to set up fifo as an empty ring over buffer[0..size-1].
+****************************************************************************/
+void i2c_fifo_init(I2CFifo *fifo, uint8_t *buffer, uint8_t size)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		fifo->buffer = buffer;
+		fifo->size = size;
+		fifo->head = fifo->tail = fifo->full = 0;
+	}
+}
+
+/****************************************************************************
+Call this function to install the table of FIFO ports.  The table must stay
+valid while the slave is running.
+****************************************************************************/
+void i2c_fifo_ports(I2CFifoPort *ports, uint8_t count)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		i2c_fifoPorts = ports;
+		i2c_fifoPortCount = count;
+		i2c_txFifo = i2c_rxFifo = NULL;
+	}
+}
+
+/****************************************************************************
+Call this function to add a byte to a FIFO (normally a port's out FIFO).
+Returns 1 on success, 0 if the FIFO is full.
+****************************************************************************/
+uint8_t i2c_fifo_push(I2CFifo *fifo, uint8_t data)
+{
+	uint8_t result;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		result = i2c_fifo_put(fifo, data);
+	}
+	return(result);
+}
+
+/****************************************************************************
+Call this function to take the oldest byte from a FIFO (normally a port's in
+FIFO).  Returns 1 on success, 0 if the FIFO is empty.
+****************************************************************************/
+uint8_t i2c_fifo_pop(I2CFifo *fifo, uint8_t *data)
+{
+	uint8_t result;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		result = i2c_fifo_get(fifo, data);
+	}
+	return(result);
+}
+
+/****************************************************************************
+Call this function to find out how many bytes are waiting in a FIFO.
+****************************************************************************/
+uint8_t i2c_fifo_depth(I2CFifo *fifo)
+{
+	uint8_t result;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (fifo->full)
+			result = fifo->size;
+		else if (fifo->head >= fifo->tail)
+			result = fifo->head - fifo->tail;
+		else
+			result = fifo->size - fifo->tail + fifo->head;
+	}
+	return(result);
+}
+#endif
+
+#if defined(I2C_ENABLE_WRITE_TRACKING) || defined(I2C_ENABLE_STAGED_WRITES)
+// Register the current master write started at
+static I2CRegIndex i2c_writeStart = 0;
+#endif
+
+#ifdef I2C_ENABLE_STAGED_WRITES
+// Data bytes of the current master write, waiting for STOP
+static uint8_t i2c_stage[I2C_STAGE_SIZE];
+static uint8_t i2c_stageFull = 0;      // No room for another byte, NACK the next one
+#endif
+
+#ifdef I2C_ENABLE_WRITE_TRACKING
+// One bit per register, set when a completed master write stored to it
+static volatile uint8_t i2c_registerDirty[I2C_DIRTY_BYTES];
+static volatile uint8_t i2c_dirtyPending = 0;
+static void (*i2c_writeCallback)(I2CRegIndex firstReg, I2CRegIndex count) = NULL;
+
+/****************************************************************************
+Call this function to find out which registers masters have written since
+the last call.  Returns 0 straight away if nothing has changed.  Otherwise
+copies the dirty bitmap (I2C_DIRTY_BYTES long, bit (reg & 7) of byte reg/8)
+into dirty, clears it and returns 1.
+****************************************************************************/
+uint8_t i2c_registers_changed(uint8_t *dirty)
+{
+	uint8_t i;
+
+	if (!i2c_dirtyPending)
+		return(0);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		for(i=0; i<I2C_DIRTY_BYTES; i++)
+		{
+			dirty[i] = i2c_registerDirty[i];
+			i2c_registerDirty[i] = 0;
+		}
+		i2c_dirtyPending = 0;
+	}
+	return(1);
+}
+
+/****************************************************************************
+Call this function to have callback run (from the ISR, so keep it short) each
+time a master write completes or is cut short, with the first register written
+and the number of data bytes in the write.  Pass NULL to turn it off.
+****************************************************************************/
+void i2c_set_write_callback(void (*callback)(I2CRegIndex firstReg, I2CRegIndex count))
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		i2c_writeCallback = callback;
+	}
+}
+
+// Post the registers a master write stored to - rxIdx counts the index byte(s) as well.
+// Runs at STOP or repeated START, and on a bus error, since the bytes that made it into
+// the map before the write was cut short have still changed.
+static inline void i2c_post_write(I2CRegIndex rxIdx)
+{
+	I2CRegIndex n, reg = i2c_writeStart;
+
+	if (rxIdx <= I2C_REG_BYTES)
+		return;
+
+	n = rxIdx - I2C_REG_BYTES;
+#ifdef I2C_ENABLE_FIFO
+	if (NULL != i2c_rxFifo)
+		n = 1;   // Everything went to the one FIFO port
+#endif
+	I2C_ATTR_SEEK(reg);
+	for(; n != 0 && I2C_REG_IN_MAP(reg) && (reg>>3) < I2C_DIRTY_BYTES; n--, reg = I2C_REG_WRAP(reg + 1))
+	{
+		if (!I2C_ATTR_READONLY(reg))
+			i2c_registerDirty[reg>>3] |= _BV(reg & 0x07);
+		I2C_ATTR_NEXT(reg);
+	}
+	i2c_dirtyPending = 1;
+	if (NULL != i2c_writeCallback)
+		(*i2c_writeCallback)(i2c_writeStart, rxIdx - I2C_REG_BYTES);
+}
+#endif
+
+#ifdef I2C_ENABLE_STATS
+static I2CSlaveStats i2c_stats;
+static uint16_t i2c_startTime = 0;
+#ifdef I2C_STATS_REGISTER
+static I2CSlaveStats i2c_statsCopy;   // What a master reading the stats registers sees
+static uint8_t i2c_statsCopied = 0;   // The current read has taken its copy
+#endif
+
+#define I2C_STATS_COUNT(field)  (i2c_stats.field++)
+#define I2C_STATS_BEGIN()       (i2c_startTime = I2C_STATS_TIMER)
+#define I2C_STATS_END()         (i2c_stats.busyTime += (uint16_t)(I2C_STATS_TIMER - i2c_startTime))
+
+/****************************************************************************
+Call this function to get a consistent copy of the slave's counters.
+****************************************************************************/
+void i2c_stats_snapshot(I2CSlaveStats *stats)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		memcpy(stats, &i2c_stats, sizeof(I2CSlaveStats));
+	}
+}
+
+void i2c_stats_reset(void)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		memset(&i2c_stats, 0, sizeof(I2CSlaveStats));
+	}
+}
+#else
+#define I2C_STATS_COUNT(field)  ((void)0)
+#define I2C_STATS_BEGIN()       ((void)0)
+#define I2C_STATS_END()         ((void)0)
+#endif
+
+#ifdef I2C_SNAPSHOT_SIZE
+// Copy of the snapshot region taken at SLA+R, and how deep the application is in an update
+static uint8_t i2c_snapshot[I2C_SNAPSHOT_SIZE];
+static volatile uint8_t i2c_snapshotLock = 0;
+// Map the copy came from (NULL until the first one), and whether the current read may use it
+static volatile uint8_t *i2c_snapshotMap = NULL;
+static uint8_t i2c_snapshotValid = 0;
+
+/****************************************************************************
+Call these functions around any application update to registers in the
+snapshot region.  A read that starts while an update is in progress is not
+copied.  It is served whatever copy the last read took.  That copy is
+consistent, but it may be many updates old, because only reads take copies.
+Interrupts don't have to be disabled, and calls may nest.  If no copy of the
+device being read exists yet, the live registers are sent, torn or not.
+****************************************************************************/
+void i2c_snapshot_begin(void)
+{
+	i2c_snapshotLock++;
+}
+
+void i2c_snapshot_end(void)
+{
+	i2c_snapshotLock--;
+}
+#endif
+
 void i2c_slave_init(uint8_t i2c_address, uint8_t i2c_all_call)
 {
 	i2c_state = I2C_NO_STATE;
 	TWBR = I2C_TWBR;
+#ifdef I2C_NO_GENERAL_CALL
+	(void)i2c_all_call;
+	TWAR = ((i2c_address<<1) & 0xFE);                                                 // Set own TWI slave address, general calls compiled out
+#else
 	TWAR = ((i2c_address<<1) & 0xFE) | (i2c_all_call?1:0);                            // Set own TWI slave address. Accept TWI General Calls.
+#endif
 	TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT);
 	i2c_busy = 0;
 }    
     
+#ifdef I2C_MULTI_ADDRESS
+/****************************************************************************
+Call this function to start the slave answering to every address in
+devices[0..count-1], each with its own register map.  The list must stay
+valid while the slave is running.
+****************************************************************************/
+void i2c_slave_init_multi(I2CSlaveDevice *devices, uint8_t count, uint8_t i2c_all_call)
+{
+	uint8_t i, mask = 0;
+
+	for(i=1; i<count; i++)
+		mask |= devices[i].address ^ devices[0].address;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		i2c_devices = devices;
+		i2c_deviceCount = count;
+		i2c_device = &devices[0];
+		i2c_registerMap = i2c_device->registerMap;
+		i2c_registerAttributes = i2c_device->registerAttributes;
+		i2c_registerMapSize = i2c_device->registerMapSize;
+	}
+
+	TWAMR = (mask<<1) & 0xFE;
+	i2c_slave_init(devices[0].address, i2c_all_call);
+}
+
+/****************************************************************************
+Call this function to find out which device (index into the list passed to
+i2c_slave_init_multi()) was addressed most recently.  Returns 0xFF if it was
+an address the mask matched but the list doesn't contain.
+****************************************************************************/
+uint8_t i2c_slave_device(void)
+{
+	return((&i2c_noDevice == i2c_device) ? 0xFF : (uint8_t)(i2c_device - i2c_devices));
+}
+
+// Switch to the device at the address the master just sent, keeping each device's register pointer
+static void i2c_select_device(uint8_t address, I2CRegIndex *registerIdx)
+{
+	uint8_t i;
+
+	i2c_device->registerIdx = *registerIdx;
+	i2c_device = &i2c_noDevice;
+	for(i=0; i<i2c_deviceCount; i++)
+	{
+		if (i2c_devices[i].address == address)
+		{
+			i2c_device = &i2c_devices[i];
+			break;
+		}
+	}
+	i2c_registerMap = i2c_device->registerMap;
+	i2c_registerAttributes = i2c_device->registerAttributes;
+	i2c_registerMapSize = i2c_device->registerMapSize;
+	*registerIdx = i2c_device->registerIdx;
+}
+#endif
+
 /****************************************************************************
 Call this function to fetch the state information of the previous operation. The function will hold execution (loop)
 until the I2C_ISR has completed with the previous operation. If there was an error, then the function 
@@ -36,86 +501,322 @@ I2CState i2c_get_state(void)
   return ( i2c_state );                         // Return error state. 
 }
 
+/****************************************************************************
+Every byte on the bus is clock stretched for as long as this ISR runs.  The
+stock build is written to make no calls ("make isr-calls" checks it), so only
+the registers the ISR uses are saved.
+I2C_NO_GENERAL_CALL, I2C_NO_READONLY and I2C_MAP_SIZE trim the byte paths
+further; I2C_PACKED_ATTRIBUTES adds a mask shift per byte written.  Options that call
+out of the ISR (I2C_MULTI_ADDRESS, I2C_ENABLE_REGIONS, I2C_ENABLE_FIFO, a
+write callback) make it save every call-clobbered register on each interrupt.
+The snapshot copy, the staged write commit, the write tracking post and the
+stats copy run once per transaction and grow with their sizes.
+
+Worst case cycles from the vector to RETI with avr-gcc -Os for the ATmega328p,
+as counted by "make isr-cycles OPTS=..." - every branch followed, each loop run
+once (add 7 for the interrupt response and the vector's JMP).  "make isr-budget"
+fails if one of these option sets has grown past its figure, or still has "-"
+because it hasn't been measured.  "make isr-calls" fails if the ISR contains a
+call.
+
+	isr-budget  base                                                     -
+	isr-budget  I2C_NO_GENERAL_CALL+I2C_NO_READONLY+I2C_MAP_SIZE=64      -
+	isr-budget  I2C_ENABLE_STAGED_WRITES                                 -
+	isr-budget  I2C_ENABLE_WRITE_TRACKING                                -
+	isr-budget  I2C_ENABLE_STATS                                         -
+	isr-budget  I2C_PACKED_ATTRIBUTES+I2C_ENABLE_STAGED_WRITES           -
+****************************************************************************/
 ISR(TWI_vect)
 {
-	static uint8_t i2c_rxIdx=0;
-	static uint8_t i2c_txIdx=0;
-	static uint8_t i2c_registerIdx=0;
+	static I2CRegIndex i2c_rxIdx=0;
+	static I2CRegIndex i2c_txIdx=0;
+	static I2CRegIndex i2c_registerIdx=0;
 
 	uint8_t i;
 	switch (TWSR)
 	{
 		case I2C_STX_ADR_ACK:              // Own SLA+R has been received; ACK has been returned
+			I2C_STATS_BEGIN();
+			I2C_STATS_COUNT(addressMatches);
+#ifdef I2C_MULTI_ADDRESS
+			i2c_select_device(TWDR>>1, &i2c_registerIdx);
+#endif
 			i2c_txIdx   = i2c_registerIdx; // Set buffer pointer to first data location
+#ifdef I2C_ENABLE_FIFO
+			{
+				I2CFifoPort *port = i2c_find_fifo(i2c_txIdx);
+				i2c_txFifo = (NULL != port) ? port->out : NULL;
+			}
+#endif
+#ifdef I2C_ENABLE_REGIONS
+			i2c_find_span(i2c_txIdx);
+#endif
+#ifdef I2C_SNAPSHOT_SIZE
+			// Capture the region once per read, unless the application is halfway through changing it
+			if (0 == i2c_snapshotLock && (I2C_SNAPSHOT_START + I2C_SNAPSHOT_SIZE) <= i2c_registerMapSize)
+			{
+				for(i=0; i<I2C_SNAPSHOT_SIZE; i++)
+					i2c_snapshot[i] = i2c_registerMap[I2C_SNAPSHOT_START + i];
+				i2c_snapshotMap = i2c_registerMap;
+			}
+			// An older copy is only good if it was taken from this device's map - a device
+			// with no map (i2c_noDevice) matches the NULL of "no copy yet", so rule that out
+			i2c_snapshotValid = (NULL != i2c_snapshotMap && i2c_snapshotMap == i2c_registerMap);
+#endif
+#if defined(I2C_ENABLE_STATS) && defined(I2C_STATS_REGISTER)
+			i2c_statsCopied = 0;
+#endif
+			// Fall through
 		case I2C_STX_DATA_ACK:             // Data byte in TWDR has been transmitted; ACK has been received
+			I2C_STATS_COUNT(bytesSent);
+#if defined(I2C_ENABLE_STATS) && defined(I2C_STATS_REGISTER)
+			if ((I2CRegIndex)(i2c_txIdx - I2C_STATS_REGISTER) < sizeof(I2CSlaveStats))
+			{
+				// Copy the counters once per read, whether it starts in the block or runs into it
+				if (!i2c_statsCopied)
+				{
+					i2c_statsCopy = i2c_stats;
+					i2c_statsCopied = 1;
+				}
+				TWDR = ((uint8_t*)&i2c_statsCopy)[i2c_txIdx++ - I2C_STATS_REGISTER];
+			}
+			else
+#endif
+#ifdef I2C_ENABLE_FIFO
+			if (NULL != i2c_txFifo)
+			{
+				if (!i2c_fifo_get(i2c_txFifo, &i))
+				{
+					I2C_STATS_COUNT(overruns);
+					i = 0xFF;
+				}
+				TWDR = i;
+			}
+			else
+#endif
+#ifdef I2C_SNAPSHOT_SIZE
+			if (i2c_snapshotValid && (I2CRegIndex)(i2c_txIdx - I2C_SNAPSHOT_START) < I2C_SNAPSHOT_SIZE)
+				TWDR = i2c_snapshot[i2c_txIdx++ - I2C_SNAPSHOT_START];
+			else
+#endif
+#ifdef I2C_ENABLE_REGIONS
+			{
+				if (i2c_txIdx > i2c_spanLast)
+					i2c_find_span(i2c_txIdx);
+
+				switch(i2c_spanSource)
+				{
+					case I2CREG_SOURCE_RAM:
+						TWDR = i2c_registerMap[i2c_txIdx];
+						break;
+					case I2CREG_SOURCE_PROGMEM:
+						TWDR = pgm_read_byte(i2c_spanData + (I2CRegIndex)(i2c_txIdx - i2c_spanFirst));
+						break;
+					case I2CREG_SOURCE_EEPROM:
+						// Note this stalls if the application has an EEPROM write in progress
+						TWDR = eeprom_read_byte(i2c_spanData + (I2CRegIndex)(i2c_txIdx - i2c_spanFirst));
+						break;
+					default:
+						I2C_STATS_COUNT(overruns);
+						TWDR = 0xFF;
+						break;
+				}
+				if (I2C_REG_MAX != i2c_txIdx)
+					i2c_txIdx++;
+			}
+#elif defined(I2C_MAP_SIZE)
+			TWDR = i2c_registerMap[I2C_REG_WRAP(i2c_txIdx++)];
+#else
 			if (i2c_txIdx < i2c_registerMapSize)
 				TWDR = i2c_registerMap[i2c_txIdx++];
 			else
+			{
+				I2C_STATS_COUNT(overruns);
 				TWDR = 0xFF;
+			}
+#endif
 			TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWEA);
 			i2c_busy = 1;
 			break;
 
 		case I2C_STX_DATA_NACK:          // Data byte in TWDR has been transmitted; NACK has been received. 
+			I2C_STATS_END();
 			TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWEA);
 			i2c_busy = 0;   // Transmit is finished, we are not busy anymore
 			break;     
 
+#ifndef I2C_NO_GENERAL_CALL
 		case I2C_SRX_GEN_ACK:            // General call address has been received; ACK has been returned
+#endif
 		case I2C_SRX_ADR_ACK:            // Own SLA+W has been received ACK has been returned
+			I2C_STATS_BEGIN();
+			I2C_STATS_COUNT(addressMatches);
+#if defined(I2C_MULTI_ADDRESS) && defined(I2C_NO_GENERAL_CALL)
+			i2c_select_device(TWDR>>1, &i2c_registerIdx);
+#elif defined(I2C_MULTI_ADDRESS)
+			// TWDR holds the SLA+W we matched (0x00 for a general call, which goes to the first device)
+			i2c_select_device((I2C_SRX_GEN_ACK == TWSR && 0 != i2c_deviceCount) ? i2c_devices[0].address : TWDR>>1, &i2c_registerIdx);
+#endif
 			i2c_rxIdx = 0;               // Set buffer pointer to first data location
+#ifdef I2C_ENABLE_STAGED_WRITES
+			i2c_stageFull = 0;
+#endif
 			TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWEA);
 			i2c_busy = 1;
 			break;
 
 		case I2C_SRX_ADR_DATA_ACK:       // Previously addressed with own SLA+W; data has been received; ACK has been returned
+#ifndef I2C_NO_GENERAL_CALL
 		case I2C_SRX_GEN_DATA_ACK:       // Previously addressed with general call; data has been received; ACK has been returned
+#endif
 			i = TWDR;
-			if (0 == i2c_rxIdx)
+			I2C_STATS_COUNT(bytesReceived);
+			if (i2c_rxIdx < I2C_REG_BYTES)
 			{
-				// First byte of a write, this will become our new register index
+				// First byte(s) of a write, this will become our new register index
+#ifdef I2C_16BIT_REGISTERS
+				i2c_registerIdx = (i2c_registerIdx << 8) | i;   // High byte first
+#else
 				i2c_registerIdx = i;
-				i2c_rxIdx++;
-			} else if (i2c_rxIdx >= i2c_registerMapSize) {
+#endif
+				if (I2C_REG_BYTES == ++i2c_rxIdx)
+				{
+#ifdef I2C_MAP_SIZE
+					i2c_registerIdx = I2C_REG_WRAP(i2c_registerIdx);
+#endif
+#if defined(I2C_ENABLE_WRITE_TRACKING) || defined(I2C_ENABLE_STAGED_WRITES)
+					i2c_writeStart = i2c_registerIdx;
+#endif
+#ifndef I2C_ENABLE_STAGED_WRITES
+					I2C_ATTR_SEEK(i2c_registerIdx);
+#endif
+#ifdef I2C_ENABLE_FIFO
+					{
+						I2CFifoPort *port = i2c_find_fifo(i2c_registerIdx);
+						i2c_rxFifo = (NULL != port) ? port->in : NULL;
+					}
+#endif
+				}
+#ifdef I2C_ENABLE_FIFO
+			} else if (NULL != i2c_rxFifo) {
+				// Stream into the port's FIFO without moving the register pointer
+				if (!i2c_fifo_put(i2c_rxFifo, i))
+					I2C_STATS_COUNT(overruns);
+				if (I2C_REG_MAX != i2c_rxIdx)
+					i2c_rxIdx++;
+#endif
+#ifndef I2C_MAP_SIZE
+			} else if (i2c_registerIdx >= i2c_registerMapSize) {
 				// NACK the SOB
-				if (255 != i2c_rxIdx)
+				I2C_STATS_COUNT(overruns);
+				if (I2C_REG_MAX != i2c_rxIdx)
 					i2c_rxIdx++;
-				if (255 != i2c_registerIdx)
+				if (I2C_REG_MAX != i2c_registerIdx)
 					i2c_registerIdx++;
 					
 
+#endif
 			} else {
+#ifdef I2C_ENABLE_STAGED_WRITES
+				// Subsequent byte of a write.  Hold it until STOP
+				i2c_stage[i2c_rxIdx - I2C_REG_BYTES] = i;
+				if (I2C_STAGE_SIZE - 1 == i2c_rxIdx - I2C_REG_BYTES)
+					i2c_stageFull = 1;
+#else
 				// Subsequent byte of a write.  If register marked writable, write it
-				if (!(i2c_registerAttributes[i2c_registerIdx] & I2CREG_ATTR_READONLY))
+				if (!I2C_ATTR_READONLY(i2c_registerIdx))
 					i2c_registerMap[i2c_registerIdx]	= i;
+				I2C_ATTR_NEXT(i2c_registerIdx);
+#endif
 
-				if (255 != i2c_rxIdx)
+				if (I2C_REG_MAX != i2c_rxIdx)
 					i2c_rxIdx++;
 					
-				if (255 != i2c_registerIdx)
+#ifdef I2C_MAP_SIZE
+				i2c_registerIdx = I2C_REG_WRAP(i2c_registerIdx + 1);
+#else
+				if (I2C_REG_MAX != i2c_registerIdx)
 					i2c_registerIdx++;
+#endif
 			}
 				
+#ifdef I2C_ENABLE_STAGED_WRITES
+			// Once the stage is full, NACK the next byte so the master knows the write was refused
+			TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | (i2c_stageFull ? 0 : _BV(TWEA));
+#else
 			TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWEA);
+#endif
 			i2c_busy = 1;
 			break;
 
 		case I2C_SRX_STOP_RESTART:       // A STOP condition or repeated START condition has been received while still addressed as Slave    
                                                         // Enter not addressed mode and listen to address match
+#ifdef I2C_ENABLE_STAGED_WRITES
+#ifdef I2C_ENABLE_FIFO
+			if (NULL != i2c_rxFifo)
+				;   // Streamed straight into the FIFO, nothing staged
+			else
+#endif
+			if (i2c_rxIdx > I2C_REG_BYTES)
+			{
+				I2CRegIndex n, reg = i2c_writeStart;
+				I2C_ATTR_SEEK(reg);
+				for(n=0; n < (I2CRegIndex)(i2c_rxIdx - I2C_REG_BYTES) && I2C_REG_IN_MAP(reg); n++, reg = I2C_REG_WRAP(reg + 1))
+				{
+					if (!I2C_ATTR_READONLY(reg))
+						i2c_registerMap[reg] = i2c_stage[n];
+					I2C_ATTR_NEXT(reg);
+				}
+			}
+#endif
+#ifdef I2C_ENABLE_WRITE_TRACKING
+			// Post the registers this write actually changed
+			i2c_post_write(i2c_rxIdx);
+			i2c_rxIdx = 0;
+#endif
+			I2C_STATS_END();
 			TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWEA);  // Enable TWI-interface and release TWI pins
 			i2c_busy = 0;  // We are waiting for a new address match, so we are not busy
 			break;           
 
+#ifdef I2C_ENABLE_STAGED_WRITES
+		case I2C_SRX_ADR_DATA_NACK:      // Previously addressed with own SLA+W; data has been received; NOT ACK has been returned
+#ifndef I2C_NO_GENERAL_CALL
+		case I2C_SRX_GEN_DATA_NACK:      // Previously addressed with general call; data has been received; NOT ACK has been returned
+#endif
+			// Only a byte that didn't fit in the stage is NACKed.  Too long to apply
+			// atomically, so don't apply any of it, and go back to listening for our address
+			I2C_STATS_COUNT(overruns);
+			I2C_STATS_END();
+			i2c_rxIdx = 0;
+			TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWEA);
+			i2c_busy = 0;
+			break;
+#endif
+
+#ifndef I2C_ENABLE_STAGED_WRITES
 		case I2C_SRX_ADR_DATA_NACK:      // Previously addressed with own SLA+W; data has been received; NOT ACK has been returned
+#ifndef I2C_NO_GENERAL_CALL
 		case I2C_SRX_GEN_DATA_NACK:      // Previously addressed with general call; data has been received; NOT ACK has been returned
+#endif
+#endif
 		case I2C_STX_DATA_ACK_LAST_BYTE: // Last data byte in TWDR has been transmitted (TWEA = \930\94); ACK has been received
 //    case I2C_NO_STATE              // No relevant state information available; TWINT = \930\94
 		case I2C_BUS_ERROR:         // Bus error due to an illegal START or STOP condition
+#if defined(I2C_ENABLE_STAGED_WRITES)
+			i2c_rxIdx = 0;                    // Throw away anything staged
+#elif defined(I2C_ENABLE_WRITE_TRACKING)
+			i2c_post_write(i2c_rxIdx);        // Bytes stored before the abort still changed the map
+			i2c_rxIdx = 0;
+#endif
+			I2C_STATS_COUNT(busErrors);
+			I2C_STATS_END();
 			i2c_state = TWSR;                 //Store TWI State as errormessage, operation also clears noErrors bit
 			TWCR = _BV(TWSTO) | _BV(TWINT); //Recover from I2C_BUS_ERROR, this will release the SDA and SCL pins thus enabling other devices to use the bus
 			break;
 
 		default:     
+			I2C_STATS_COUNT(unknownStates);
 			i2c_state = TWSR;                                 // Store TWI State as errormessage, operation also clears the Success bit.      
 			TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWEA);
       
@@ -26,6 +26,155 @@ LICENSE:
 #define I2C_FREQ 400000
 #define I2C_TWBR ( ((F_CPU) / (2UL * (I2C_FREQ))) - 8UL)
 
+// Register addressing - by default the first byte of a write is the register pointer and
+// maps can have up to 255 registers.  Define I2C_16BIT_REGISTERS for a two byte pointer
+// (high byte first, like a 24C32 EEPROM) and maps of up to 65535 registers; the
+// application's i2c_registerMapSize becomes a uint16_t.
+#ifdef I2C_16BIT_REGISTERS
+typedef uint16_t I2CRegIndex;
+#define I2C_REG_MAX    0xFFFF
+#define I2C_REG_BYTES  2
+#else
+typedef uint8_t I2CRegIndex;
+#define I2C_REG_MAX    0xFF
+#define I2C_REG_BYTES  1
+#endif
+
+// Trimming the ISR - every byte on the bus is clock stretched for as long as the ISR
+// runs, so these drop work at compile time that a particular slave doesn't need:
+//   I2C_NO_GENERAL_CALL  - general call states aren't handled (i2c_all_call is ignored)
+//   I2C_NO_READONLY      - no attribute lookup on writes; i2c_registerAttributes[] isn't used
+//   I2C_MAP_SIZE         - fixed map size, a power of two.  Replaces i2c_registerMapSize;
+//                          the register pointer wraps instead of being bounds checked
+#if defined(I2C_MAP_SIZE) && (I2C_MAP_SIZE & (I2C_MAP_SIZE - 1))
+#error I2C_MAP_SIZE must be a power of two
+#endif
+#if defined(I2C_MAP_SIZE) && (I2C_MAP_SIZE > I2C_REG_MAX + 1)
+#error I2C_MAP_SIZE is bigger than the register pointer can reach, define I2C_16BIT_REGISTERS
+#endif
+#if defined(I2C_MAP_SIZE) && (defined(I2C_MULTI_ADDRESS) || defined(I2C_ENABLE_REGIONS))
+#error I2C_MAP_SIZE cannot be combined with I2C_MULTI_ADDRESS or I2C_ENABLE_REGIONS
+#endif
+
+// Packed attributes - define I2C_PACKED_ATTRIBUTES and i2c_registerAttributes[] becomes a
+// bitmap of I2C_ATTR_BYTES(i2c_registerMapSize) bytes, bit (reg & 7) of byte reg/8 set
+// for each read-only register, instead of one byte per register.  A write looks its
+// registers up by walking a mask along the bitmap, loading a byte every eighth register,
+// so each byte written costs about the same as with unpacked attributes.
+#define I2C_ATTR_BYTES(registers)  (((registers) + 7) / 8)
+
+// Multiple addresses - define I2C_MULTI_ADDRESS and start the slave with
+// i2c_slave_init_multi() instead of i2c_slave_init().  Each device gets its own register
+// map, attributes and register pointer.  TWAMR is set to cover every address in the list;
+// an address the mask lets through that isn't in the list reads as 0xFF and ignores writes.
+// General calls go to the first device.  Snapshot, region and write tracking settings
+// apply by register number to whichever device is addressed.
+typedef struct
+{
+	uint8_t address;                         // 7-bit slave address
+	volatile uint8_t *registerMap;
+	volatile uint8_t *registerAttributes;
+	I2CRegIndex registerMapSize;
+	I2CRegIndex registerIdx;                 // Register pointer, kept between transactions
+} I2CSlaveDevice;
+
+// Constant regions - define I2C_ENABLE_REGIONS and supply i2c_registerRegions[] (in
+// PROGMEM) and i2c_registerRegionCount.  Reads that land in a region are served from flash
+// or EEPROM instead of i2c_registerMap.  Regions are read-only and take priority over the
+// RAM map; put them above i2c_registerMapSize so they don't cost any RAM.
+#define I2CREG_SOURCE_NONE     0
+#define I2CREG_SOURCE_RAM      1
+#define I2CREG_SOURCE_PROGMEM  2
+#define I2CREG_SOURCE_EEPROM   3
+
+typedef struct
+{
+	I2CRegIndex first;     // First register in the region
+	I2CRegIndex last;      // Last register in the region
+	uint8_t source;        // I2CREG_SOURCE_PROGMEM or I2CREG_SOURCE_EEPROM
+	const uint8_t *data;   // Value of register first, in flash or EEPROM
+} I2CRegisterRegion;
+
+// Snapshot region - define I2C_SNAPSHOT_SIZE to have registers I2C_SNAPSHOT_START through
+// I2C_SNAPSHOT_START + I2C_SNAPSHOT_SIZE - 1 copied when a master addresses us for a read,
+// so multi-byte values in that range aren't torn.  Wrap application updates to the region
+// in i2c_snapshot_begin() / i2c_snapshot_end().  A read during an update gets the copy the
+// last read took, which may be many updates old.
+#ifdef I2C_SNAPSHOT_SIZE
+#ifndef I2C_SNAPSHOT_START
+#define I2C_SNAPSHOT_START 0
+#endif
+#endif
+
+// FIFO ports - define I2C_ENABLE_FIFO and install a table of I2CFifoPort with
+// i2c_fifo_ports().  A read that starts at a port's register pops bytes from its out FIFO
+// (0xFF once it's empty) and a write to it pushes into its in FIFO (dropped once full);
+// either way the register pointer stays put, so a master can drain a whole batch in one
+// burst.  A burst that runs into a port from the register below reads the map as usual.
+typedef struct
+{
+	uint8_t *buffer;
+	uint8_t size;
+	volatile uint8_t head;
+	volatile uint8_t tail;
+	volatile uint8_t full;
+} I2CFifo;
+
+typedef struct
+{
+	I2CRegIndex reg;   // Register number the port appears at
+	I2CFifo *out;      // Application to master, or NULL
+	I2CFifo *in;       // Master to application, or NULL
+} I2CFifoPort;
+
+// Staged writes - define I2C_ENABLE_STAGED_WRITES and master writes are held in a staging
+// buffer and only copied into the register map, all at once, on STOP or repeated START.
+// A write that fails part way (bus error, NACK) or is longer than I2C_STAGE_SIZE data bytes
+// changes nothing - the first data byte past I2C_STAGE_SIZE is NACKed, so the master sees
+// the write refused.  Registers written in one transaction always commit together; with
+// I2C_ENABLE_WRITE_TRACKING the dirty bitmap and callback fire once, after the commit.
+// The transaction is the only commit group: there is no way to group registers across
+// transactions or hold back part of one write, so registers that must change together
+// have to be adjacent and written in a single burst.
+#ifdef I2C_ENABLE_STAGED_WRITES
+#ifndef I2C_STAGE_SIZE
+#define I2C_STAGE_SIZE 16
+#endif
+#endif
+
+// Write tracking - define I2C_ENABLE_WRITE_TRACKING to have every register a master writes
+// marked in a dirty bitmap when the write finishes (STOP or repeated START), or when a
+// bus error cuts it short - without staged writes, bytes stored before the error count.
+// Registers past the first I2C_DIRTY_BYTES * 8 still trigger the callback, but have no dirty bit.
+#ifdef I2C_ENABLE_WRITE_TRACKING
+#ifndef I2C_DIRTY_BYTES
+#define I2C_DIRTY_BYTES 32
+#endif
+#endif
+
+#ifdef I2C_ENABLE_STATS
+// Slave telemetry, compiled in with I2C_ENABLE_STATS.  Times are in counts of
+// I2C_STATS_TIMER, which must be a free-running 16 bit timer set up by the application.
+// Define I2C_STATS_REGISTER to also let masters read the counters from sizeof(I2CSlaveStats)
+// registers starting there, laid out as below, little endian.  They're copied when a read
+// first reaches the block, whether it starts there or runs into it, and served from the
+// copy, not i2c_registerMap - the application uses i2c_stats_snapshot() to see them.
+#ifndef I2C_STATS_TIMER
+#define I2C_STATS_TIMER    TCNT1
+#endif
+
+typedef struct
+{
+	uint16_t addressMatches;    // SLA+R, SLA+W and general calls we answered
+	uint32_t bytesReceived;     // Bytes written by masters, including the register pointer
+	uint32_t bytesSent;
+	uint16_t overruns;          // Bytes read or written past the end of the map, or a FIFO or stage
+	uint16_t busErrors;         // Bus errors and transfers aborted part way
+	uint16_t unknownStates;     // TWI states the ISR doesn't handle
+	uint32_t busyTime;          // Timer counts from address match to STOP or the final NACK
+} I2CSlaveStats;
+#endif
+
 
 /****************************************************************************
   TWI State codes
@@ -76,4 +225,32 @@ typedef enum
 I2CState i2c_get_state(void);
 void i2c_slave_init(uint8_t i2c_address, uint8_t i2c_all_call);
 
+#ifdef I2C_MULTI_ADDRESS
+void i2c_slave_init_multi(I2CSlaveDevice *devices, uint8_t count, uint8_t i2c_all_call);
+uint8_t i2c_slave_device(void);
+#endif
+
+#ifdef I2C_ENABLE_FIFO
+void i2c_fifo_init(I2CFifo *fifo, uint8_t *buffer, uint8_t size);
+void i2c_fifo_ports(I2CFifoPort *ports, uint8_t count);
+uint8_t i2c_fifo_push(I2CFifo *fifo, uint8_t data);
+uint8_t i2c_fifo_pop(I2CFifo *fifo, uint8_t *data);
+uint8_t i2c_fifo_depth(I2CFifo *fifo);
+#endif
+
+#ifdef I2C_ENABLE_WRITE_TRACKING
+uint8_t i2c_registers_changed(uint8_t *dirty);
+void i2c_set_write_callback(void (*callback)(I2CRegIndex firstReg, I2CRegIndex count));
+#endif
+
+#ifdef I2C_ENABLE_STATS
+void i2c_stats_snapshot(I2CSlaveStats *stats);
+void i2c_stats_reset(void);
+#endif
+
+#ifdef I2C_SNAPSHOT_SIZE
+void i2c_snapshot_begin(void);
+void i2c_snapshot_end(void);
+#endif
+
 
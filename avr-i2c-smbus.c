@@ -0,0 +1,122 @@
+/*************************************************************************
+Title:    MRBus AVR I2C Library - SMBus Master Protocols
+Authors:  Nathan D. Holmes <maverick@drgw.net>
+File:     avr-i2c-smbus.c
+License:  GNU General Public License v3
+
+LICENSE:
+    Copyright (C) 2012 Nathan Holmes
+
+    Implements the read/write byte, word and block protocols of section 5.5
+    of the SMBus specification on top of the master driver, with optional
+    Packet Error Correction (PEC).  See http://smbus.org/ for details.  No
+    claim of compatibility or compliance to any standard is being made here.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+*************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include "avr-i2c-smbus.h"
+
+static uint8_t smbus_flags = I2C_XFER_SEND_STOP;
+
+// Send tx (command code and any data), then read rxLength bytes if asked
+static uint8_t smbus_transaction(uint8_t address, uint8_t *tx, uint8_t txLength, uint8_t *rx, uint8_t rxLength, uint8_t flags)
+{
+	I2CTransaction t;
+
+	memset(&t, 0, sizeof(t));
+	t.address = address << 1;
+	t.buffer = tx;
+	t.length = txLength;
+	t.rxBuffer = rx;
+	t.rxLength = rxLength;
+	t.flags = smbus_flags | flags;
+	i2c_transfer(&t);
+	return(t.status);
+}
+
+/****************************************************************************
+Call this function to turn PEC on or off for all following SMBus calls.  PEC is only
+available if the master driver is built with I2C_ENABLE_PEC.
+****************************************************************************/
+void smbus_use_pec(uint8_t enable)
+{
+#ifdef I2C_ENABLE_PEC
+	smbus_flags = I2C_XFER_SEND_STOP | (enable ? I2C_XFER_PEC : 0);
+#else
+	(void)enable;
+#endif
+}
+
+uint8_t smbus_write_byte(uint8_t address, uint8_t cmd, uint8_t value)
+{
+	uint8_t tx[2] = { cmd, value };
+	return(smbus_transaction(address, tx, 2, NULL, 0, 0));
+}
+
+uint8_t smbus_read_byte(uint8_t address, uint8_t cmd, uint8_t *value)
+{
+	return(smbus_transaction(address, &cmd, 1, value, 1, 0));
+}
+
+// SMBus words go low byte first
+uint8_t smbus_write_word(uint8_t address, uint8_t cmd, uint16_t value)
+{
+	uint8_t tx[3] = { cmd, value & 0xFF, value >> 8 };
+	return(smbus_transaction(address, tx, 3, NULL, 0, 0));
+}
+
+uint8_t smbus_read_word(uint8_t address, uint8_t cmd, uint16_t *value)
+{
+	uint8_t rx[2];
+	uint8_t result = smbus_transaction(address, &cmd, 1, rx, 2, 0);
+
+	if (I2C_XFER_DONE == result)
+		*value = rx[0] | ((uint16_t)rx[1] << 8);
+	return(result);
+}
+
+/****************************************************************************
+Call this function to write a block of up to SMBUS_BLOCK_MAX bytes.  The count is sent
+ahead of the data.
+****************************************************************************/
+uint8_t smbus_write_block(uint8_t address, uint8_t cmd, const uint8_t *data, uint8_t len)
+{
+	uint8_t tx[SMBUS_BLOCK_MAX + 2];
+
+	if (len > SMBUS_BLOCK_MAX)
+		return(I2C_XFER_BLOCK_SIZE);
+
+	tx[0] = cmd;
+	tx[1] = len;
+	memcpy(tx + 2, data, len);
+	return(smbus_transaction(address, tx, len + 2, NULL, 0, 0));
+}
+
+/****************************************************************************
+Call this function to read a block.  The count the slave reports lands in block[0] and
+the data follows from block[1]; the read stops as soon as the data (and PEC) are in.
+size is the space available in block, including the count byte, so it must be at least 1.
+A block that doesn't fit returns I2C_XFER_BLOCK_SIZE.  The count byte has already been
+ACKed by the time it is seen, and the TWI can't STOP until it has NACKed a byte, so a
+count of 0 without PEC is followed by one more byte, NACKed straight away and discarded.
+****************************************************************************/
+uint8_t smbus_read_block(uint8_t address, uint8_t cmd, uint8_t *block, uint8_t size)
+{
+	// With no room for the count there'd be no read phase at all, just the command write
+	if (0 == size)
+		return(I2C_XFER_BLOCK_SIZE);
+	return(smbus_transaction(address, &cmd, 1, block, size, I2C_XFER_BLOCK));
+}
@@ -0,0 +1,46 @@
+/*************************************************************************
+Title:    MRBus AVR I2C Library - SMBus Master Protocols
+Authors:  Nathan D. Holmes <maverick@drgw.net>
+File:     avr-i2c-smbus.h
+License:  GNU General Public License v3
+
+LICENSE:
+    Copyright (C) 2012 Nathan Holmes
+
+    Implements the read/write byte, word and block protocols of section 5.5
+    of the SMBus specification on top of the master driver, with optional
+    Packet Error Correction (PEC).  See http://smbus.org/ for details.  No
+    claim of compatibility or compliance to any standard is being made here.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+*************************************************************************/
+
+#ifndef _AVR_I2C_SMBUS_H
+#define _AVR_I2C_SMBUS_H
+
+#include "avr-i2c-master.h"
+
+#define SMBUS_BLOCK_MAX  32   // Largest block the SMBus specification allows
+
+// All calls wait for the transaction and return its I2CTransaction status -
+// I2C_XFER_DONE on success, I2C_XFER_PEC_ERROR if the PEC didn't check out, etc.
+// Addresses are 7 bit.
+
+void smbus_use_pec(uint8_t enable);
+uint8_t smbus_write_byte(uint8_t address, uint8_t cmd, uint8_t value);
+uint8_t smbus_read_byte(uint8_t address, uint8_t cmd, uint8_t *value);
+uint8_t smbus_write_word(uint8_t address, uint8_t cmd, uint16_t value);
+uint8_t smbus_read_word(uint8_t address, uint8_t cmd, uint16_t *value);
+uint8_t smbus_write_block(uint8_t address, uint8_t cmd, const uint8_t *data, uint8_t len);
+uint8_t smbus_read_block(uint8_t address, uint8_t cmd, uint8_t *block, uint8_t size);
+
+#endif
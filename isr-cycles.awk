@@ -0,0 +1,168 @@
+# Worst case cycles through an AVR interrupt handler, from the "avr-objdump -dr" listing
+# of it that "make isr" writes.  Every branch is followed, each loop is counted once and
+# calls are counted but not followed.  Cycle counts are for the classic AVR core
+# (ATmega328p); add the interrupt response and the vector table's JMP (7 cycles there).
+#
+#   awk -f isr-cycles.awk build/isr.lst
+#   awk -f isr-cycles.awk -v name="avr-i2c-slave base" -v budget=120 build/isr.lst
+#
+# With a budget it exits 1 if the handler takes longer, or if the budget is "-" (not
+# recorded yet).
+
+function hex(s,   i, n)
+{
+	s = tolower(s)
+	sub(/^0x/, "", s)
+	n = 0
+	for (i = 1; i <= length(s); i++)
+		n = n * 16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+	return n
+}
+
+function fail(msg)
+{
+	print name ": " msg > "/dev/stderr"
+	failed = 1
+	exit 2
+}
+
+# Sets e1/c1 and e2/c2 to the instructions that can follow a, and the cycles a takes to
+# get to each.  e1 = -1 for RETI.
+function edges(a,   o, n)
+{
+	o = op[a]
+	n = nxt[a]
+	e2 = -1
+	if (o == "reti" || o == "ret") {
+		e1 = -1; c1 = 4
+	} else if (o ~ /^br/ && o != "break") {
+		e1 = n; c1 = 1; e2 = target[a]; c2 = 2
+	} else if (o == "rjmp") {
+		e1 = target[a]; c1 = 2
+	} else if (o == "jmp") {
+		e1 = target[a]; c1 = 3
+	} else if (o ~ /^(e?ijmp)$/) {
+		fail(sprintf("computed jump at 0x%x can't be followed", a))
+	} else if (o ~ /^(cpse|sbrc|sbrs|sbic|sbis)$/) {
+		e1 = n; c1 = 1; e2 = nxt[n]; c2 = 1 + size[n] / 2
+	} else if (o == "call" || o == "eicall") {
+		e1 = n; c1 = 4; calls[a] = 1
+	} else if (o == "rcall" || o == "icall") {
+		e1 = n; c1 = 3; calls[a] = 1
+	} else if (o ~ /^(lpm|elpm)$/) {
+		e1 = n; c1 = 3
+	} else if (o ~ /^(ld|ldd|lds|st|std|sts|push|pop|adiw|sbiw|sbi|cbi|mul|muls|mulsu|fmul|fmuls|fmulsu)$/) {
+		e1 = n; c1 = 2
+	} else {
+		e1 = n; c1 = 1
+	}
+	if ((e1 >= 0 && !(e1 in op)) || (e2 >= 0 && !(e2 in op)))
+		fail(sprintf("branch at 0x%x leaves the handler", a))
+}
+
+# Longest path from the vector to RETI.  A depth first walk marks the edges that go back
+# to an instruction still on the walk; those close loops, which are then counted once.
+# Every other successor finishes before the instruction that leads to it, so working
+# through the instructions in the order they finish sees each successor's figure first.
+function longest(entry,   sp, a, k, t, i, n, best, r)
+{
+	sp = 1; stack[1] = entry; step[1] = 0; state[entry] = 1
+	n = 0
+	while (sp) {
+		a = stack[sp]
+		k = ++step[sp]
+		t = (k == 1) ? to1[a] : (k == 2) ? to2[a] : -2
+		if (t == -2) {
+			state[a] = 2
+			done[++n] = a
+			sp--
+		} else if (t >= 0) {
+			if (state[t] == 1)
+				back[a, k] = 1
+			else if (!state[t]) {
+				stack[++sp] = t; step[sp] = 0; state[t] = 1
+			}
+		}
+	}
+
+	for (i = 1; i <= n; i++) {
+		a = done[i]
+		best = -1
+		if (to1[a] < 0)
+			best = cost1[a]
+		else if (!((a, 1) in back) && (r = cycles[to1[a]]) >= 0)
+			best = cost1[a] + r
+		if (to2[a] >= 0 && !((a, 2) in back) && (r = cycles[to2[a]]) >= 0 && cost2[a] + r > best)
+			best = cost2[a] + r
+		cycles[a] = best
+	}
+	return cycles[entry]
+}
+
+/^[0-9a-f]+ <__vector_[0-9]+>:/ {
+	start = hex($1)
+	vector = substr($2, 2, length($2) - 3)
+	next
+}
+
+/^ *[0-9a-f]+:\t/ {
+	split($0, f, "\t")
+	gsub(/[ :]/, "", f[1])
+	last = hex(f[1])
+	size[last] = split(f[2], bytes, " ")
+	op[last] = f[3]
+	if (match($0, /; 0x[0-9a-f]+/))
+		target[last] = hex(substr($0, RSTART + 2, RLENGTH - 2))
+	addr[++count] = last
+	next
+}
+
+# Unlinked object - a jump's real target is in its relocation
+/^\t+[0-9a-f]+: R_AVR/ {
+	sym = $NF
+	if (sym ~ /^\.text\+0x/)
+		target[last] = hex(substr(sym, 7))
+	else if (index(sym, vector "+0x") == 1)
+		target[last] = start + hex(substr(sym, length(vector) + 2))
+	else if (sym == ".text" || sym == vector)
+		target[last] = start
+	else if (op[last] ~ /jmp$/)
+		fail(sprintf("jump at 0x%x leaves the handler for %s", last, sym))
+}
+
+END {
+	if (failed)
+		exit 2
+	if (!count)
+		fail("no interrupt handler in the listing")
+	for (i = 1; i <= count; i++)
+		nxt[addr[i]] = addr[i] + size[addr[i]]
+	for (i = 1; i <= count; i++) {
+		edges(addr[i])
+		to1[addr[i]] = e1; cost1[addr[i]] = c1
+		to2[addr[i]] = e2; cost2[addr[i]] = c2
+	}
+	total = longest(addr[1])
+	if (total < 0)
+		fail("no path reaches RETI")
+
+	n = 0
+	for (a in calls)
+		n++
+	printf "%s%s%d cycles from the vector to RETI", name, (name != "") ? ": " : "", total
+	if (n)
+		printf ", plus whatever the %d call(s) take", n
+	if (budget == "") {
+		printf "\n"
+		exit 0
+	}
+	if (budget == "-") {
+		printf " - no budget recorded\n"
+		exit 1
+	}
+	if (total > budget + 0) {
+		printf " - over its budget of %d\n", budget
+		exit 1
+	}
+	printf " (budget %d)\n", budget
+}